@@ -0,0 +1,157 @@
+#!/usr/bin/env python
+#-*- coding:utf-8 -*-
+
+# Writes animated webp files (RIFF/WEBP with VP8X, ANIM and ANMF chunks).
+#
+# The headers are written when the muxer is created and every frame is
+# appended as soon as it is added, so the output can be read while frames
+# are still being encoded. The RIFF size and the alpha flag are only known
+# at the end. They are fixed up in place when the output is seekable.
+#
+# A pipe or socket cannot be rewritten, so there the data still goes out as
+# it comes, with a provisional RIFF size: STREAM_RIFF_SIZE, the largest one
+# libwebp accepts, which says the file runs past the data received so far.
+# Progressive readers (WebPDemuxPartial(), browsers) read such a stream up
+# to its last complete frame. The alpha flag is set up front. Write to a
+# file to get the exact size.
+
+import struct
+
+# libwebp's MAX_CHUNK_PAYLOAD
+STREAM_RIFF_SIZE = 0xFFFFFFF6
+
+VP8X_ALPHA = 0x10
+VP8X_ANIMATION = 0x02
+
+ANMF_DISPOSE_BACKGROUND = 0x01
+ANMF_NO_BLEND = 0x02
+
+def _uint24(value):
+    return struct.pack('<I', value)[:3]
+
+def _chunk(fourcc, payload):
+    data = fourcc + struct.pack('<I', len(payload)) + payload
+    if len(payload) & 1:
+        data += b'\0'
+    return data
+
+def _uint24_unpack(data):
+    return struct.unpack('<I', data + b'\0')[0]
+
+def _seekable(f):
+    try:
+        return f.seekable()
+    except AttributeError:
+        # python 2 file objects
+        try:
+            f.tell()
+            return True
+        except (IOError, OSError):
+            return False
+
+def frame_chunks(webp):
+    # Returns the ALPH/VP8/VP8L chunks of a still webp file (as written by cwebp) and whether it has alpha.
+    if len(webp) < 12 or webp[0:4] != b'RIFF' or webp[8:12] != b'WEBP':
+        raise ValueError('Not a webp file')
+
+    chunks = b''
+    has_alpha = False
+    pos = 12
+    end = min(len(webp), 8 + struct.unpack('<I', webp[4:8])[0])
+    while pos + 8 <= end:
+        fourcc = webp[pos:pos+4]
+        size = struct.unpack('<I', webp[pos+4:pos+8])[0]
+        payload = webp[pos+8:pos+8+size]
+        if fourcc == b'ALPH':
+            has_alpha = True
+            chunks += _chunk(fourcc, payload)
+        elif fourcc == b'VP8L':
+            # the alpha_is_used bit follows the signature byte and the 14 bit width and height
+            if len(payload) >= 5 and (struct.unpack('<I', payload[1:5])[0] >> 28) & 1:
+                has_alpha = True
+            chunks += _chunk(fourcc, payload)
+        elif fourcc == b'VP8 ':
+            chunks += _chunk(fourcc, payload)
+        pos += 8 + size + (size & 1)
+
+    if not chunks:
+        raise ValueError('No image data in webp file')
+    return chunks, has_alpha
+
+def webp_size(webp):
+    # Returns the (width, height) of a still webp file.
+    pos = 12
+    while pos + 8 <= len(webp):
+        fourcc = webp[pos:pos+4]
+        size = struct.unpack('<I', webp[pos+4:pos+8])[0]
+        payload = webp[pos+8:pos+8+size]
+        if fourcc == b'VP8X':
+            return _uint24_unpack(payload[4:7]) + 1, _uint24_unpack(payload[7:10]) + 1
+        if fourcc == b'VP8L':
+            bits = struct.unpack('<I', payload[1:5])[0]
+            return (bits & 0x3FFF) + 1, ((bits >> 14) & 0x3FFF) + 1
+        if fourcc == b'VP8 ':
+            w, h = struct.unpack('<HH', payload[6:10])
+            return w & 0x3FFF, h & 0x3FFF
+        pos += 8 + size + (size & 1)
+    raise ValueError('No image data in webp file')
+
+class AnimMuxer(object):
+
+    def __init__(self, out, width, height, loop=0, bgcolor=(255, 255, 255, 255)):
+        # bgcolor is a (A, R, G, B) tuple, like the webpmux -bgcolor option.
+        if width < 1 or height < 1 or width > 1 << 24 or height > 1 << 24:
+            raise ValueError('Invalid canvas size')
+
+        self.out = out
+        self.seekable = _seekable(out)
+        self.start = out.tell() if self.seekable else 0
+        self.size = 0
+        self.has_alpha = False
+
+        a, r, g, b = bgcolor
+        riff_size = 0 if self.seekable else STREAM_RIFF_SIZE
+        flags = VP8X_ANIMATION if self.seekable else VP8X_ANIMATION | VP8X_ALPHA
+        self._write(b'RIFF' + struct.pack('<I', riff_size) + b'WEBP')
+        self._write(_chunk(b'VP8X', struct.pack('<B', flags) + b'\0\0\0' + _uint24(width - 1) + _uint24(height - 1)))
+        self._write(_chunk(b'ANIM', struct.pack('<BBBBH', b, g, r, a, loop)))
+        self.out.flush()
+
+    def _write(self, data):
+        self.out.write(data)
+        self.size += len(data)
+
+    def add_frame(self, webp, x, y, duration, dispose_op, blend_op):
+        # webp is a still webp file. dispose_op and blend_op use the APNG values: 1 is dispose to background, 0 is no blending.
+        if x & 1 or y & 1:
+            raise ValueError('Webp frame offsets must be even')
+        if duration < 0 or duration >= 1 << 24:
+            raise ValueError('Invalid frame duration')
+        if dispose_op not in (0, 1):
+            raise ValueError("Webp can't handle this dispose operation")
+        if blend_op not in (0, 1):
+            raise ValueError("Webp can't handle this blend operation")
+
+        chunks, has_alpha = frame_chunks(webp)
+        width, height = webp_size(webp)
+        flags = 0
+        if dispose_op == 1:
+            flags |= ANMF_DISPOSE_BACKGROUND
+        if blend_op == 0:
+            flags |= ANMF_NO_BLEND
+
+        header = _uint24(x // 2) + _uint24(y // 2) + _uint24(width - 1) + _uint24(height - 1) + _uint24(duration) + struct.pack('<B', flags)
+        self._write(_chunk(b'ANMF', header + chunks))
+        self.has_alpha = self.has_alpha or has_alpha
+        self.out.flush()
+
+    def close(self):
+        if self.seekable:
+            end = self.out.tell()
+            self.out.seek(self.start + 4)
+            self.out.write(struct.pack('<I', self.size - 8))
+            if self.has_alpha:
+                self.out.seek(self.start + 20)
+                self.out.write(struct.pack('<B', VP8X_ANIMATION | VP8X_ALPHA))
+            self.out.seek(end)
+        self.out.flush()
@@ -9,94 +9,461 @@ import errno
 from tempfile import mkdtemp
 import shutil
 import argparse
+import time
+
+try:
+    import resource
+except ImportError:
+    # not on Windows
+    resource = None
 
 if os.name == 'nt':
     import pbs
     apng2webp_apngopt = pbs.Command('apng2webp_apngopt')
     apngdisraw = pbs.Command('apngdisraw')
     cwebp = pbs.Command('cwebp')
-    webpmux = pbs.Command('webpmux')
 else:
-    from sh import apng2webp_apngopt, apngdisraw, cwebp, webpmux
+    from sh import apng2webp_apngopt, apngdisraw, cwebp
+
+try:
+    from apng2webp.animmux import AnimMuxer
+except ImportError:
+    from animmux import AnimMuxer
+
+# cwebp options from the highest to the lowest effort, lossless and lossy, with their encoding time per pixel relative to the first.
+cwebp_efforts = [
+    (['-lossless', '-q', '100'], ['-m', '4'], 1.0),
+    (['-lossless', '-q', '50', '-m', '2'], ['-m', '2'], 0.25),
+    (['-lossless', '-q', '0', '-m', '0'], ['-m', '0'], 0.05),
+]
+
+# With --encoding auto, frames with at most this many colors are encoded lossless, the others lossy.
+auto_lossless_colors = 256
+
+def cwebp_effort(time_left, pixels_left, time_per_pixel):
+    # Returns the highest effort that encodes the remaining pixels in time, projected from the time per pixel measured so far.
+    if time_per_pixel is None:
+        return 0 if time_left > 0 else len(cwebp_efforts) - 1
+    for effort, (lossless_options, lossy_options, cost) in enumerate(cwebp_efforts):
+        if pixels_left * time_per_pixel * cost <= time_left:
+            return effort
+    return len(cwebp_efforts) - 1
+
+def cwebp_options(lossless, effort, quality, alpha_quality):
+    if lossless:
+        return cwebp_efforts[effort][0]
+    return ['-q', str(quality), '-alpha_q', str(alpha_quality)] + cwebp_efforts[effort][1]
+
+def cwebp_data(options, png_frame_file):
+    # cwebp writes the webp file to stdout, so it does not have to be read back from disk.
+    return cwebp(*(options + [png_frame_file, '-o', '-'])).stdout
+
+def encode_frame(png_frame_file, encoding, quality, alpha_quality, colors=None, effort=0):
+    # Returns the still webp file and True when it was encoded lossless.
+    if encoding == 'mixed':
+        lossless_data = cwebp_data(cwebp_options(True, effort, quality, alpha_quality), png_frame_file)
+        lossy_data = cwebp_data(cwebp_options(False, effort, quality, alpha_quality), png_frame_file)
+        if len(lossy_data) >= len(lossless_data):
+            return lossless_data, True
+        return lossy_data, False
+
+    lossless = encoding == 'lossless' or (encoding == 'auto' and colors <= auto_lossless_colors)
+    return cwebp_data(cwebp_options(lossless, effort, quality, alpha_quality), png_frame_file), lossless
+
+def cpu_ms():
+    # User and system time of this process and of the child processes that finished, like cwebp.
+    t = os.times()
+    return (t[0] + t[1] + t[2] + t[3]) * 1000.0
+
+def peak_rss_kb(who):
+    if resource is None:
+        return 0
+    kb = resource.getrusage(who).ru_maxrss
+    if sys.platform == 'darwin':
+        kb //= 1024
+    return kb
 
-def apng2webp(input_file, output_file, tmpdir, loop, bgcolor):
+class Stage(object):
+    # Adds the time spent in a with block to a stage of the --stats output.
+    # The peak memory is that of the driver, or that of a child process when
+    # one ran during the stage and went higher than all child processes
+    # before it (the system only keeps the highest).
+    # With a trace list, every block is also added to it as a trace event.
+    def __init__(self, name, trace=None):
+        self.stage = {'name': name, 'tool': 'apng2webp', 'calls': 0, 'wall_ms': 0.0, 'cpu_ms': 0.0, 'peak_rss_kb': 0}
+        self.trace = trace
+
+    def __enter__(self):
+        self.wall = time.time()
+        self.cpu = cpu_ms()
+        self.children_rss = peak_rss_kb(resource.RUSAGE_CHILDREN) if resource else 0
+        return self
+
+    def __exit__(self, *exc):
+        stage = self.stage
+        stage['calls'] += 1
+        stage['wall_ms'] += (time.time() - self.wall) * 1000.0
+        stage['cpu_ms'] += cpu_ms() - self.cpu
+        peak = peak_rss_kb(resource.RUSAGE_SELF) if resource else 0
+        children_rss = peak_rss_kb(resource.RUSAGE_CHILDREN) if resource else 0
+        if children_rss > self.children_rss:
+            peak = max(peak, children_rss)
+        stage['peak_rss_kb'] = max(stage['peak_rss_kb'], peak)
+        if self.trace is not None:
+            self.trace.append(trace_event(stage['name'], self.wall, time.time(), {'call': stage['calls']}))
+        return False
+
+def trace_event(name, start, end, args=None):
+    # A Chrome trace event of the driver. Timestamps are microseconds, like those of the tools.
+    event = {'name': name, 'ph': 'X', 'pid': os.getpid(), 'tid': 1, 'ts': round(start * 1e6, 3), 'dur': round((end - start) * 1e6, 3)}
+    if args:
+        event['args'] = args
+    return event
+
+def add_tool_trace(trace, trace_file):
+    # Adds the events of an apngopt or apngdisraw --trace file.
+    with open(trace_file, 'r') as f:
+        trace.extend(json.load(f)['traceEvents'])
+
+def add_tool_stats(stats, stats_file, tool):
+    # Adds the stages of an apngopt or apngdisraw --stats file to stats, and the rest (per frame lists, heap
+    # allocations when the tools were built with TRACK_ALLOC) under the tool name.
+    with open(stats_file, 'r') as f:
+        tool_stats = json.load(f)
+    for stage in tool_stats['stages']:
+        stage['tool'] = tool
+    stats['stages'].extend(tool_stats['stages'])
+    stats[tool] = dict((key, value) for key, value in tool_stats.items() if isinstance(value, (list, dict)) and key != 'stages')
+
+def parse_bgcolor(bgcolor):
+    # The A,R,G,B format of the --bgcolor option.
+    try:
+        color = tuple(int(c) for c in bgcolor.split(','))
+    except ValueError:
+        color = ()
+    if len(color) != 4 or any(c < 0 or c > 255 for c in color):
+        raise ValueError('bgcolor must be four numbers from 0 to 255: A,R,G,B')
+    return color
+
+def stdout_binary():
+    # Like pipe_stdout() of the tools: points stdout at stderr, so the messages stay out of the output, and returns a binary stream on the real stdout.
+    sys.stdout.flush()
+    fd = os.dup(sys.stdout.fileno())
+    os.dup2(sys.stderr.fileno(), sys.stdout.fileno())
+    if os.name == 'nt':
+        import msvcrt
+        msvcrt.setmode(fd, os.O_BINARY)
+    return os.fdopen(fd, 'wb')
+
+def apng2webp(input_file, output_file, tmpdir, loop, bgcolor, apngopt_args=[], deadline=None, encoding='lossless', quality=75, alpha_quality=100, stats=None, trace=None):
+    # With a stats dict, the stages of the conversion are appended to stats['stages'] and the frames to stats['frames'].
+    # With a trace list, the trace events of the driver and the tools are appended to it.
+    # output_file is a path or a binary stream, which is left open.
 
     de_optimised_file = path.join(tmpdir, "de-optimised.png")
     animation_json_file = path.join(tmpdir, "animation_metadata.json")
+    apngopt_stats_file = path.join(tmpdir, "apngopt_stats.json")
+    apngdisraw_stats_file = path.join(tmpdir, "apngdisraw_stats.json")
+    apngopt_trace_file = path.join(tmpdir, "apngopt_trace.json")
+    apngdisraw_trace_file = path.join(tmpdir, "apngdisraw_trace.json")
+    apngopt_args = apngopt_args + ['--quiet']
+    apngdisraw_args = ['--quiet']
+    if stats is not None:
+        apngopt_args = apngopt_args + ['--stats', apngopt_stats_file]
+        apngdisraw_args = apngdisraw_args + ['--stats', apngdisraw_stats_file]
+    if trace is not None:
+        apngopt_args = apngopt_args + ['--trace', apngopt_trace_file]
+        apngdisraw_args = apngdisraw_args + ['--trace', apngdisraw_trace_file]
+
+    if deadline is not None:
+        # apngopt gets a quarter of the time left, the cwebp calls get the rest.
+        apngopt_ms = max(1, int((deadline - time.time()) * 1000 / 4))
+        apngopt_args = apngopt_args + ['--deadline-ms', str(apngopt_ms)]
 
     # apng2webp_apngopt does only optimization which can be applied to webp.
     # apng2webp_apngopt does not return a error code if things go wrong at time of writing. (like can't write/read file)
-    apng2webp_apngopt(input_file, de_optimised_file )
+    with Stage('apngopt', trace):
+        result = apng2webp_apngopt(*(apngopt_args + [input_file, de_optimised_file]))
+    # The reports of --memory-budget and --deadline-ms, which apngopt prints also with --quiet.
+    for line in result.stdout.decode('utf-8', 'replace').splitlines():
+        if line.startswith('memory budget') or line.endswith('to meet the deadline') or line.endswith('compressed at reduced effort'):
+            print(line)
 
-    apngdisraw( de_optimised_file, 'animation' )
+    if encoding == 'auto':
+        apngdisraw_args = apngdisraw_args + ['--colors']
+    with Stage('apngdisraw', trace):
+        apngdisraw(*(apngdisraw_args + [de_optimised_file, 'animation']))
 
     with open(animation_json_file, 'r') as f:
         animation = json.load(f)
 
-    webpmux_args = []
+    # Frames are appended to the output as soon as they are encoded.
+    out = output_file if hasattr(output_file, 'write') else open(output_file, 'wb')
+    mux = AnimMuxer(out, animation['width'], animation['height'], loop or 0, bgcolor or (255, 255, 255, 255))
+
+    pixels_left = sum(frame['w'] * frame['h'] for frame in animation['frames'])
+    encode_time = 0.0
+    encode_pixels = 0.0 # Pixels encoded so far, weighted by the cost of their effort.
+    reduced = []
+    lossy_frames = 0
+    encode_stage = Stage('encode', trace)
+    mux_stage = Stage('mux', trace)
     for frame in animation['frames']:
         png_frame_file = path.join(tmpdir, frame['src'])
-        webp_frame_file = path.join(tmpdir, frame['src']+".webp")
 
-        cwebp('-lossless', '-q', '100', png_frame_file, '-o', webp_frame_file)
+        effort = 0
+        if deadline is not None:
+            effort = cwebp_effort(deadline - time.time(), pixels_left, encode_time / encode_pixels if encode_pixels else None)
+            if effort > 0:
+                reduced.append((frame['src'], effort))
 
-        delay = int(round(float(frame['delay_num']) / float(frame['delay_den']) * 1000))
+        start = time.time()
+        with encode_stage:
+            webp_data, lossless = encode_frame(png_frame_file, encoding, quality, alpha_quality, frame.get('colors'), effort)
+        if not lossless:
+            lossy_frames += 1
+        encode_time += time.time() - start
+        if stats is not None:
+            stats['frames'].append({'src': frame['src'], 'x': frame['x'], 'y': frame['y'], 'w': frame['w'], 'h': frame['h'],
+                                    'lossless': lossless, 'effort': effort, 'encode_ms': round((time.time() - start) * 1000.0, 3), 'size': len(webp_data)})
+        encode_pixels += frame['w'] * frame['h'] * cwebp_efforts[effort][2]
+        pixels_left -= frame['w'] * frame['h']
 
-        if delay == 0: # The specs say zero is allowed, but should be treated as 10 ms.
-            delay = 10;
+        delay_den = frame['delay_den']
+        if delay_den == 0:
+            delay_den = 100 # The specs say a zero denominator should be treated as 100.
 
-        if frame['blend_op'] == 0:
-            blend_mode = '-b'
-        elif frame['blend_op'] == 1:
-            blend_mode = '+b'
+        if frame['delay_num'] == 0 and frame['delay_den'] == 0: # A sub-frame written by apngopt --split, shown together with the next frame.
+            delay = 0
         else:
-            raise ValueError("Webp can't handle this blend operation")
+            delay = int(round(float(frame['delay_num']) / float(delay_den) * 1000))
 
-        webpmux_args.append('-frame')
-        webpmux_args.append(webp_frame_file)
-        webpmux_args.append('+' + str(delay) + '+' + str(frame['x']) + '+' + str(frame['y']) + '+' + str(frame['dispose_op']) + blend_mode )
-    
-    if(loop is not None):
-        webpmux_args = webpmux_args + ['-loop', loop]
-    if(bgcolor is not None):
-        webpmux_args = webpmux_args + ['-bgcolor', bgcolor]
-    
-    webpmux_args = webpmux_args + ['-o', output_file]
-    webpmux(*webpmux_args)
+            if delay == 0: # The specs say zero is allowed, but should be treated as 10 ms.
+                delay = 10;
+
+        with mux_stage:
+            mux.add_frame(webp_data, frame['x'], frame['y'], delay, frame['dispose_op'], frame['blend_op'])
+
+    with mux_stage:
+        mux.close()
+        if out is not output_file:
+            out.close()
+
+    if stats is not None:
+        stats['output_size'] = mux.size
+        add_tool_stats(stats, apngopt_stats_file, 'apngopt')
+        add_tool_stats(stats, apngdisraw_stats_file, 'apngdisraw')
+        stats['stages'].append(encode_stage.stage)
+        stats['stages'].append(mux_stage.stage)
+    if trace is not None:
+        add_tool_trace(trace, apngopt_trace_file)
+        add_tool_trace(trace, apngdisraw_trace_file)
+
+    if encoding in ('mixed', 'auto'):
+        print('%d of %d frames encoded lossy' % (lossy_frames, len(animation['frames'])))
+    if deadline is not None:
+        print('%d of %d frames encoded at reduced effort' % (len(reduced), len(animation['frames'])))
+        for src, effort in reduced:
+            print('  %s: effort %d of %d' % (src, effort, len(cwebp_efforts) - 1))
+
+def apng2webp_poster(input_file, output_file, tmpdir, encoding='lossless', quality=75, alpha_quality=100, stats=None, trace=None):
+
+    # apngdisraw writes its frames next to its input, so give it a path inside tmpdir.
+    poster_input_file = path.join(tmpdir, "poster_input.png")
+    if path.lexists(poster_input_file):
+        os.remove(poster_input_file)
+    try:
+        os.symlink(path.abspath(input_file), poster_input_file)
+    except (AttributeError, NotImplementedError, OSError):
+        shutil.copyfile(input_file, poster_input_file)
+
+    # Only the first displayable frame is decoded, so this does not depend on the amount of frames.
+    apngdisraw_args = ['--first-frame', '--quiet']
+    apngdisraw_stats_file = path.join(tmpdir, "apngdisraw_stats.json")
+    apngdisraw_trace_file = path.join(tmpdir, "apngdisraw_trace.json")
+    if stats is not None:
+        apngdisraw_args = apngdisraw_args + ['--stats', apngdisraw_stats_file]
+    if trace is not None:
+        apngdisraw_args = apngdisraw_args + ['--trace', apngdisraw_trace_file]
+    if encoding == 'auto':
+        apngdisraw_args = apngdisraw_args + ['--colors']
+    with Stage('apngdisraw', trace):
+        apngdisraw(*(apngdisraw_args + [poster_input_file, 'poster']))
+
+    with open(path.join(tmpdir, "poster_metadata.json"), 'r') as f:
+        animation = json.load(f)
+
+    frame = animation['frames'][0]
+    encode_stage = Stage('encode', trace)
+    start = time.time()
+    with encode_stage:
+        webp_data, lossless = encode_frame(path.join(tmpdir, frame['src']), encoding, quality, alpha_quality, frame.get('colors'))
+    if hasattr(output_file, 'write'):
+        output_file.write(webp_data)
+        output_file.flush()
+    else:
+        with open(output_file, 'wb') as f:
+            f.write(webp_data)
+
+    if stats is not None:
+        stats['output_size'] = len(webp_data)
+        add_tool_stats(stats, apngdisraw_stats_file, 'apngdisraw')
+        stats['stages'].append(encode_stage.stage)
+        stats['frames'].append({'src': frame['src'], 'x': frame['x'], 'y': frame['y'], 'w': frame['w'], 'h': frame['h'],
+                                'lossless': lossless, 'effort': 0, 'encode_ms': round((time.time() - start) * 1000.0, 3), 'size': len(webp_data)})
+    if trace is not None:
+        add_tool_trace(trace, apngdisraw_trace_file)
+
+def apngopt_options(args):
+    apngopt_args = []
+    if args.scale > 1:
+        apngopt_args = apngopt_args + ['--scale', str(args.scale)]
+    if args.crop:
+        apngopt_args = apngopt_args + ['--crop']
+    if args.merge_threshold is not None:
+        apngopt_args = apngopt_args + ['--merge-threshold', str(args.merge_threshold)]
+        if args.merge_fraction is not None:
+            apngopt_args = apngopt_args + ['--merge-fraction', str(args.merge_fraction)]
+    if args.rect_threshold is not None:
+        apngopt_args = apngopt_args + ['--rect-threshold', str(args.rect_threshold)]
+    if args.max_fps is not None:
+        apngopt_args = apngopt_args + ['--max-fps', str(args.max_fps)]
+    if args.kmax is not None:
+        apngopt_args = apngopt_args + ['--kmax', str(args.kmax)]
+        if args.kmin is not None:
+            apngopt_args = apngopt_args + ['--kmin', str(args.kmin)]
+    if args.split:
+        apngopt_args = apngopt_args + ['--split']
+    if args.stream:
+        apngopt_args = apngopt_args + ['--stream']
+    if args.memory_budget is not None:
+        apngopt_args = apngopt_args + ['--memory-budget', str(args.memory_budget)]
+    return apngopt_args
 
 def main():
 
     parser = argparse.ArgumentParser(description='Convert animated png files (apng) to animated webp files.')
     parser.add_argument('input', type=str, nargs=1, help='Input path. Must be a .png file.')
-    parser.add_argument('output', type=str, nargs='?', default=None, help='Output path. If output file already exist it will be overwritten.')
-    parser.add_argument('-l', '--loop', type=int, nargs='?', default=None, help='Passed to webpmux. The amount of times the animation should loop. 0 to 65535. Zero indicates to loop forever.')
-    parser.add_argument('-bg', '--bgcolor', type=str, nargs='?', default=None, help='Passed to webpmux. The background color as a A,R,G,B tuple. Example: 255,255,255,255')
-    parser.add_argument('-tmp', '--tmpdir', type=str, nargs='?', default=None, help='A temp directory (it may already exist) to save the temp files during converting, including the extracted PNG images, the metadata and the converted WebP static images for each frame. If not provided, it will use the system temp path and remove temp images after executing.')
+    parser.add_argument('output', type=str, nargs='?', default=None, help='Output path, - for stdout. If output file already exist it will be overwritten. On stdout an animation gets a provisional RIFF size, see animmux.py.')
+    parser.add_argument('-l', '--loop', type=int, nargs='?', default=None, help='The amount of times the animation should loop. 0 to 65535. Zero indicates to loop forever.')
+    parser.add_argument('-bg', '--bgcolor', type=str, nargs='?', default=None, help='The background color as a A,R,G,B tuple. Example: 255,255,255,255')
+    parser.add_argument('-s', '--scale', type=int, default=1, help='Shrink the animation to 1/SCALE of its size while decoding. Useful for thumbnails. 1 to 16.')
+    parser.add_argument('-c', '--crop', action='store_true', help='Crop the canvas to the visible (non-transparent) content of all frames.')
+    parser.add_argument('--merge-threshold', type=int, default=None, help='Lossy. Merge frames into the previous frame when no pixel channel differs by more than MERGE_THRESHOLD (0 to 255). Their delays are summed.')
+    parser.add_argument('--merge-fraction', type=float, default=None, help='Used with --merge-threshold. Still merge frames when up to this fraction (0 to 1) of the pixels differ more.')
+    parser.add_argument('--rect-threshold', type=int, default=None, help='Lossy. Pixels whose channels change by at most RECT_THRESHOLD (0 to 255) keep their previous value, so the changed area of each frame gets smaller.')
+    parser.add_argument('--max-fps', type=int, default=None, help='Drop frames so the animation plays at most MAX_FPS frames per second. The total duration stays the same.')
+    parser.add_argument('--kmax', type=int, default=None, help='Write a full canvas key frame at least every KMAX frames, so players can seek without decoding from the first frame.')
+    parser.add_argument('--kmin', type=int, default=None, help='Used with --kmax. At least KMIN frames between key frames. Defaults to half of KMAX.')
+    parser.add_argument('--split', action='store_true', help='Write far apart changes of a frame as several zero duration sub-frames when that is smaller.')
+    parser.add_argument('--stream', action='store_true', help='Let apngopt decode, optimize and compress frames at the same time, keeping only a few frames in memory. Frames stay RGBA and --crop, --merge-threshold, --max-fps, --kmax, --split and --deadline-ms are not available.')
+    parser.add_argument('--memory-budget', type=int, default=None, help='Keep apngopt within MEMORY_BUDGET megabytes. Over the budget the decoded frames are kept in a spill file next to the temp files. The strategy used is reported.')
+    parser.add_argument('--deadline-ms', type=int, default=None, help='Lower the compression effort of frames when needed to finish within DEADLINE_MS milliseconds. The frames compressed (apngopt) and encoded (cwebp) at reduced effort are reported. Best effort: the time left is projected from the frames done so far, and decoding always runs at full effort, so the deadline can still be missed.')
+    parser.add_argument('-e', '--encoding', choices=['lossless', 'lossy', 'mixed', 'auto'], default='lossless', help='How frames are encoded. mixed encodes every frame both ways and keeps the smaller one. auto encodes frames with few colors lossless and the others lossy.')
+    parser.add_argument('-q', '--quality', type=int, default=75, help='Quality of lossy frames. 0 to 100.')
+    parser.add_argument('--alpha-quality', type=int, default=100, help='Quality of the transparency of lossy frames. 0 to 100.')
+    parser.add_argument('--stats', type=str, default=None, help='Write the wall time, cpu time and peak memory of every stage (decoding, each optimization, saving, frame encoding and muxing) to this JSON file, with a record for every frame: its rect, the dispose and blend ops apngopt chose, the deflate sizes it tried, its decode and encode times and its sizes.')
+    parser.add_argument('--trace', type=str, default=None, help='Write Chrome trace events of the conversion to this JSON file: the stages and the work on every frame, per process and thread, of apng2webp and the tools it runs. Open it in chrome://tracing or ui.perfetto.dev.')
+    parser.add_argument('-p', '--poster', action='store_true', help='Only convert the first frame to a static webp file (poster image). The rest of the animation is not decoded.')
+    parser.add_argument('-tmp', '--tmpdir', type=str, nargs='?', default=None, help='A temp directory (it may already exist) to save the temp files during converting, including the extracted PNG images and the metadata. If not provided, it will use the system temp path and remove temp images after executing.')
     args = parser.parse_args()
+    start = time.time()
     
     input_path = args.input[0]
     output_path = args.output
     tmpdir = args.tmpdir
     loop = args.loop
-    bgcolor = args.bgcolor
+    bgcolor = None
+    poster = args.poster
+
+    if args.scale < 1 or args.scale > 16:
+        parser.error('scale must be between 1 and 16')
+    if args.merge_threshold is not None and (args.merge_threshold < 0 or args.merge_threshold > 255):
+        parser.error('merge threshold must be between 0 and 255')
+    if args.merge_fraction is not None and (args.merge_fraction < 0 or args.merge_fraction > 1):
+        parser.error('merge fraction must be between 0 and 1')
+    if args.rect_threshold is not None and (args.rect_threshold < 0 or args.rect_threshold > 255):
+        parser.error('rect threshold must be between 0 and 255')
+    if args.max_fps is not None and (args.max_fps < 1 or args.max_fps > 1000):
+        parser.error('max fps must be between 1 and 1000')
+    if args.kmax is not None and args.kmax < 1:
+        parser.error('kmax must be at least 1')
+    if args.kmin is not None and (args.kmax is None or args.kmin < 1 or args.kmin > args.kmax):
+        parser.error('kmin must be between 1 and kmax, and needs --kmax')
+    if args.stream and (args.crop or args.merge_threshold is not None or args.max_fps is not None or args.kmax is not None or args.split or args.deadline_ms is not None):
+        parser.error('--stream can not be combined with --crop, --merge-threshold, --max-fps, --kmax, --split or --deadline-ms')
+    if loop is not None and (loop < 0 or loop > 65535):
+        parser.error('loop must be between 0 and 65535')
+    if args.bgcolor is not None:
+        try:
+            bgcolor = parse_bgcolor(args.bgcolor)
+        except ValueError as e:
+            parser.error(str(e))
+    if args.quality < 0 or args.quality > 100:
+        parser.error('quality must be between 0 and 100')
+    if args.alpha_quality < 0 or args.alpha_quality > 100:
+        parser.error('alpha quality must be between 0 and 100')
+    if args.memory_budget is not None and args.memory_budget < 1:
+        parser.error('memory budget must be at least 1 MB')
+    if args.deadline_ms is not None and args.deadline_ms < 1:
+        parser.error('deadline must be at least 1 ms')
+    deadline = None
+    if args.deadline_ms is not None:
+        deadline = start + args.deadline_ms / 1000.0
     
     if(output_path is None):
         if (input_path.lower().endswith('.png')):
             output_path = input_path[:-3] + 'webp'
         else:
             output_path = input_path + '.webp'
+    output = stdout_binary() if output_path == '-' else output_path
     
+    stats = {'stages': [], 'frames': []} if args.stats else None
+    trace = [] if args.trace else None
+
+    def convert(tmpdir):
+        if poster:
+            apng2webp_poster(input_path, output, tmpdir, args.encoding, args.quality, args.alpha_quality, stats, trace)
+        else:
+            apng2webp(input_path, output, tmpdir, loop, bgcolor, apngopt_options(args), deadline, args.encoding, args.quality, args.alpha_quality, stats, trace)
+
     if (tmpdir):
         if not os.path.exists(tmpdir):
             os.makedirs(tmpdir)
-        apng2webp(input_path, output_path, tmpdir, loop, bgcolor)
+        convert(tmpdir)
     else:
         tmpdir = mkdtemp(prefix='apng2webp_')
         try:
-            apng2webp(input_path, output_path, tmpdir, loop, bgcolor)
+            convert(tmpdir)
         finally:
             shutil.rmtree(tmpdir)
 
+    if stats is not None:
+        for stage in stats['stages']:
+            stage['wall_ms'] = round(stage['wall_ms'], 3)
+            stage['cpu_ms'] = round(stage['cpu_ms'], 3)
+        report = {
+            'tool': 'apng2webp',
+            'input': input_path,
+            'output_size': stats.pop('output_size'),
+            'wall_ms': round((time.time() - start) * 1000.0, 3),
+            'cpu_ms': round(cpu_ms(), 3),
+        }
+        report.update(stats)
+        with open(args.stats, 'w') as f:
+            json.dump(report, f, indent=2)
+            f.write('\n')
+
+    if trace is not None:
+        trace = [
+            {'name': 'process_name', 'ph': 'M', 'pid': os.getpid(), 'args': {'name': 'apng2webp'}},
+            {'name': 'thread_name', 'ph': 'M', 'pid': os.getpid(), 'tid': 1, 'args': {'name': 'main'}},
+            trace_event('apng2webp', start, time.time()),
+        ] + trace
+        with open(args.trace, 'w') as f:
+            json.dump({'displayTimeUnit': 'ms', 'traceEvents': trace}, f)
+            f.write('\n')
+
 if __name__ == "__main__":
     main();
 
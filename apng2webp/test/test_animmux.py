@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+#-*- coding:utf-8 -*-
+
+import pytest
+import io
+import os
+import struct
+
+from apng2webp.animmux import AnimMuxer, STREAM_RIFF_SIZE
+
+def still_webp(w, h, alpha):
+    # A VP8L header is all the muxer looks at, the image data does not need to be valid.
+    bits = (w - 1) | ((h - 1) << 14) | ((1 if alpha else 0) << 28)
+    payload = b'\x2f' + struct.pack('<I', bits) + b'\0'
+    return b'RIFF' + struct.pack('<I', 4 + 8 + len(payload)) + b'WEBP' + b'VP8L' + struct.pack('<I', len(payload)) + payload
+
+def chunks(data, pos=12):
+    result = []
+    while pos + 8 <= len(data):
+        size = struct.unpack('<I', data[pos+4:pos+8])[0]
+        result.append((data[pos:pos+4], data[pos+8:pos+8+size]))
+        pos += 8 + size + (size & 1)
+    return result
+
+def mux(out):
+    m = AnimMuxer(out, 64, 32, 3, (255, 1, 2, 3))
+    m.add_frame(still_webp(64, 32, False), 0, 0, 100, 0, 0)
+    m.add_frame(still_webp(10, 6, True), 4, 2, 0, 1, 1)
+    m.close()
+
+def test_animmux():
+    out = io.BytesIO()
+    mux(out)
+    data = out.getvalue()
+
+    assert(data[0:4] == b'RIFF' and data[8:12] == b'WEBP')
+    assert(struct.unpack('<I', data[4:8])[0] == len(data) - 8)
+
+    c = chunks(data)
+    assert([fourcc for fourcc, payload in c] == [b'VP8X', b'ANIM', b'ANMF', b'ANMF'])
+    assert(c[0][1] == b'\x12\0\0\0' + b'\x3f\0\0' + b'\x1f\0\0') # animation and alpha flags, canvas 64x32
+    assert(c[1][1] == b'\x03\x02\x01\xff\x03\x00') # B, G, R, A, loop count
+
+    frame = c[3][1]
+    assert(frame[0:12] == b'\x02\0\0' + b'\x01\0\0' + b'\x09\0\0' + b'\x05\0\0') # offset / 2, size - 1
+    assert(frame[12:15] == b'\0\0\0')
+    assert(frame[15] in (1, b'\x01')) # dispose to background, blend
+    assert(frame[16:20] == b'VP8L')
+
+def test_animmux_pipe():
+    out = io.BytesIO()
+    mux(out)
+    expected = out.getvalue()
+
+    r, w = os.pipe()
+    pipe = os.fdopen(w, 'wb')
+    try:
+        m = AnimMuxer(pipe, 64, 32, 3, (255, 1, 2, 3))
+        m.add_frame(still_webp(64, 32, False), 0, 0, 100, 0, 0)
+        # the first frame must be readable before the muxer is closed
+        data = os.read(r, 65536)
+        assert([fourcc for fourcc, payload in chunks(data)] == [b'VP8X', b'ANIM', b'ANMF'])
+        m.add_frame(still_webp(10, 6, True), 4, 2, 0, 1, 1)
+        m.close()
+    finally:
+        pipe.close()
+    while True:
+        more = os.read(r, 65536)
+        if not more:
+            break
+        data += more
+    os.close(r)
+
+    # everything but the provisional RIFF size matches the seekable output
+    assert(struct.unpack('<I', data[4:8])[0] == STREAM_RIFF_SIZE)
+    assert(data[:4] + data[8:] == expected[:4] + expected[8:])
+
+def test_animmux_odd_offset():
+    m = AnimMuxer(io.BytesIO(), 64, 32)
+    with pytest.raises(ValueError):
+        m.add_frame(still_webp(10, 6, False), 3, 0, 100, 0, 0)
@@ -27,3 +27,16 @@ def test_main():
             apng2webp(input_path, output_path)
             assert(os.path.exists(output_path))
 
+
+# test apng2webp cli poster mode
+def test_poster():
+    apng_dir = path.realpath(path.join(__file__, '../../../examples/apng'))
+    webp_dir = path.realpath(path.join(__file__, '../../../examples/webp'))
+
+    for f in listdir(apng_dir):
+        f_name, f_ext = path.splitext(f)
+        if f_ext == '.png':
+            input_path = path.realpath(path.join(apng_dir, f_name + '.png'))
+            output_path = path.realpath(path.join(webp_dir, f_name + '_poster.webp'))
+            apng2webp('--poster', input_path, output_path)
+            assert(os.path.exists(output_path))
@@ -31,8 +31,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "png.h"     /* original (unpatched) libpng is ok */
 #include "zlib.h"
+#include "stats.h"
+#include "pipe.h"
 
 #define notabc(c) ((c) < 65 || (c) > 122 || ((c) > 90 && (c) < 97))
 
@@ -48,23 +59,243 @@ struct APNGFrame { unsigned char * p, ** rows; unsigned int w, h, delay_num, del
 struct COLORS { unsigned int num; unsigned char r, g, b, a; };
 struct OP { unsigned char * p; unsigned int size; int x, y, w, h, valid, filters; };
 struct rgb { unsigned char r, g, b; };
-
-unsigned char * op_zbuf1;
-unsigned char * op_zbuf2;
-z_stream        op_zstream1;
-z_stream        op_zstream2;
-unsigned char * row_buf;
-unsigned char * sub_row;
-unsigned char * up_row;
-unsigned char * avg_row;
-unsigned char * paeth_row;
-OP              op[6];
+struct RECT { unsigned int x, y, w, h; };
+struct FRAMESTATS { int frame, x, y, w, h, op_best, filters, trials[4]; std::chrono::steady_clock::time_point t0, t1; };
+struct STREAMJOB { unsigned char * p; unsigned int x, y, w, h, filters, dop, bop, delay_num, delay_den; FRAMESTATS fs; };
+struct DEADLINE { unsigned int ms, frames, rects, reduced; double fin_ms, fin_px, rect_px; std::chrono::steady_clock::time_point start, save_start; };
+struct SPILL { unsigned char * base; size_t canvas, slots, window, touched; std::vector<size_t> free; };
+struct SCALER { unsigned int x, y, w, h, sx, sy, sw, sh, row, passes, cw, ch, bop; unsigned int * acc; png_bytep * rows; png_bytep * canvas; };
+
+// per thread, so the stages of --stream can search and compress rects at the same time
+thread_local unsigned char * op_zbuf1;
+thread_local unsigned char * op_zbuf2;
+thread_local z_stream        op_zstream1;
+thread_local z_stream        op_zstream2;
+thread_local unsigned char * row_buf;
+thread_local unsigned char * sub_row;
+thread_local unsigned char * up_row;
+thread_local unsigned char * avg_row;
+thread_local unsigned char * paeth_row;
+thread_local OP              op[6];
 rgb             palette[256];
 unsigned char   trns[256];
 unsigned int    palsize, trnssize;
 unsigned int    next_seq_num;
+unsigned int    scale = 1;
+unsigned int    rect_threshold = 0;
+unsigned int    split_frames = 0;
+unsigned int    kmin = 0, kmax = 0;
+unsigned int    has_offs = 0;
+unsigned int    offs_x, offs_y;
+SCALER          scaler;
+SPILL           spill;
+DEADLINE        deadline;
+int             fin_level = Z_BEST_COMPRESSION;
+unsigned int    quiet = 0;
+
+// When set, load_apng() hands every frame to it instead of storing it in the vector.
+void (*frame_fn)(APNGFrame & frame) = NULL;
+
+double ms_since(std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+}
+
+double ms_between(std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1)
+{
+  return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
 
 const unsigned long cMaxPNGSize = 1000000UL;
+const unsigned int  cSplitTile = 16;
+const unsigned int  cSplitFrameCost = 128; // fcTL/fdAT and webp ANMF overhead of an extra frame
+const unsigned int  cStreamQueue = 2; // frames waiting between two --stream stages
+const int           cFinLevels[3] = { Z_BEST_COMPRESSION, 6, Z_BEST_SPEED };
+const double        cFinCost[3] = { 1.0, 0.35, 0.1 }; // deflate time per pixel, relative to Z_BEST_COMPRESSION
+const size_t        cBaseFootprint = 6 << 20; // code, libraries and deflate state
+const unsigned int  cSaveCanvases = 10; // buffers of save_apng(), in canvases
+const unsigned int  cStreamCanvases = 16; // frames and buffers alive in --stream, in canvases
+
+/* Memory budget - begin */
+
+/* Frame canvases normally live on the heap. Over the --memory-budget they
+ * are put in a file mapped into memory instead, and the mapping is dropped
+ * from the process every time the passes have touched as many canvases as
+ * the budget leaves room for. The data stays in the file (and the page
+ * cache while there is memory to spare) and is read back when it's used
+ * again, so only the frames being worked on count against the budget.
+ */
+// Returns NULL when the spill file is full, more frames than memory_plan() counted.
+unsigned char * canvas_alloc(size_t size)
+{
+  if (spill.base && size == spill.canvas)
+  {
+    if (spill.free.empty())
+      return NULL;
+    size_t slot = spill.free.back();
+    spill.free.pop_back();
+    return spill.base + slot * spill.canvas;
+  }
+  return new unsigned char[size];
+}
+
+void canvas_free(unsigned char * p)
+{
+  if (spill.base && p >= spill.base && p < spill.base + spill.slots * spill.canvas)
+    spill.free.push_back((p - spill.base) / spill.canvas);
+  else
+    delete[] p;
+}
+
+// Called once per frame by the passes over all frames.
+inline void spill_touch()
+{
+#ifndef _WIN32
+  if (spill.base && (spill.touched += spill.canvas) >= spill.window)
+  {
+    madvise(spill.base, spill.slots * spill.canvas, MADV_DONTNEED);
+    spill.touched = 0;
+  }
+#endif
+}
+
+int spill_open(char * szOut)
+{
+#ifdef _WIN32
+  (void)szOut;
+  printf("Error: spill files aren't supported on this platform\n");
+  return 1;
+#else
+  // next to the output file, as /tmp is often kept in memory
+  char szSpill[256 + 32];
+  strcpy(szSpill, szOut);
+  char * szSlash = strrchr(szSpill, '/');
+  if (szSlash)
+    strcpy(szSlash + 1, "apngopt_spill_XXXXXX");
+  else
+    strcpy(szSpill, "apngopt_spill_XXXXXX");
+
+  int fd = mkstemp(szSpill);
+  if (fd < 0)
+  {
+    printf("Error: couldn't create spill file '%s'\n", szSpill);
+    return 1;
+  }
+  unlink(szSpill);
+
+  size_t size = spill.slots * spill.canvas;
+  void * base = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    printf("Error: couldn't map a %d MB spill file\n", (int)(size >> 20));
+    return 1;
+  }
+
+  spill.base = (unsigned char *)base;
+  for (size_t i=spill.slots; i>0; i--)
+    spill.free.push_back(i - 1);
+  return 0;
+#endif
+}
+
+void spill_close()
+{
+#ifndef _WIN32
+  if (spill.base)
+    munmap(spill.base, spill.slots * spill.canvas);
+#endif
+  spill.base = NULL;
+  spill.free.clear();
+}
+
+/* Reads the canvas size from IHDR and counts the fcTL chunks, without
+ * decoding anything. The frame count of acTL comes from the file too and
+ * may be too low. The count includes a default image that isn't part of
+ * the animation, as load_apng() keeps that one too.
+ */
+int probe_apng(char * szIn, unsigned int & w, unsigned int & h, unsigned int & num_frames, unsigned int & interlaced)
+{
+  FILE * f;
+  unsigned char sig[8], head[8], data[13];
+  int res = -1;
+
+  if ((f = pipe_open_in(szIn, true)) == 0)
+    return res;
+
+  num_frames = 1;
+  if (fread(sig, 1, 8, f) == 8 && png_sig_cmp(sig, 0, 8) == 0 &&
+      fread(head, 1, 8, f) == 8 && *(unsigned int *)(head + 4) == id_IHDR && png_get_uint_32(head) == 13 &&
+      fread(data, 1, 13, f) == 13 && fseek(f, 4, SEEK_CUR) == 0)
+  {
+    w = png_get_uint_32(data);
+    h = png_get_uint_32(data + 4);
+    interlaced = data[12];
+    res = 0;
+
+    while (fread(head, 1, 8, f) == 8)
+    {
+      unsigned int id = *(unsigned int *)(head + 4);
+      unsigned int length = png_get_uint_32(head);
+
+      if (id == id_fcTL)
+        num_frames++;
+      if (id == id_IEND || length > PNG_UINT_31_MAX || fseek(f, (long)length + 4, SEEK_CUR) != 0)
+        break;
+    }
+  }
+  fclose(f);
+  return res;
+}
+
+/* Estimates the peak memory use from the header and picks where to keep the
+ * frames: on the heap when it fits the budget, in a spill file when it
+ * doesn't. Fails when even the buffers that can't be spilled don't fit.
+ */
+int memory_plan(char * szIn, char * szOut, unsigned int budget_mb, unsigned int stream)
+{
+  unsigned int w, h, num_frames, interlaced;
+  size_t budget = (size_t)budget_mb << 20;
+
+  if (probe_apng(szIn, w, h, num_frames, interlaced) != 0 || w > cMaxPNGSize || h > cMaxPNGSize)
+    return 0; // load_apng() reports the error
+
+  size_t sw = (w + scale - 1) / scale;
+  size_t sh = (h + scale - 1) / scale;
+  size_t canvas = sw * sh * 4;
+  size_t load = canvas + ((scale > 1 && interlaced) ? (size_t)w * h * 4 : 0);
+  size_t fixed = cBaseFootprint + ((stream) ? canvas * cStreamCanvases : (load > canvas * cSaveCanvases) ? load : canvas * cSaveCanvases);
+  if (pipe_is_std(szIn))
+    fixed += pipe_io.in.size(); // probe_apng() read stdin into memory
+  size_t slots = num_frames + 1; // and the next frame while one is composed
+  size_t frames = (stream) ? 0 : slots * (canvas + sh * sizeof(png_bytep));
+
+  if (fixed + frames <= budget)
+  {
+    printf("memory budget %d MB, estimated %d MB: %s\n", budget_mb, (int)((fixed + frames) >> 20), (stream) ? "streaming" : "frames kept in memory");
+    return 0;
+  }
+
+  if (stream || fixed + 2 * canvas + slots * sh * sizeof(png_bytep) > budget)
+  {
+    size_t need = fixed + ((stream) ? 0 : 2 * canvas + slots * sh * sizeof(png_bytep));
+    printf("Error: memory budget too small, at least %d MB needed\n", (int)((need + (1 << 20) - 1) >> 20));
+    return 1;
+  }
+
+  spill.canvas = canvas;
+  spill.slots = slots;
+  spill.window = budget - fixed - canvas - slots * sh * sizeof(png_bytep);
+  spill.touched = 0;
+  if (spill_open(szOut) != 0)
+    return 1;
+
+  printf("memory budget %d MB, estimated %d MB: frames kept in a spill file\n", budget_mb, (int)((fixed + frames) >> 20));
+  return 0;
+}
+/* Memory budget - end */
 
 /* APNG decoder - begin */
 void info_fn(png_structp png_ptr, png_infop info_ptr)
@@ -73,14 +304,154 @@ void info_fn(png_structp png_ptr, png_infop info_ptr)
   png_set_strip_16(png_ptr);
   png_set_gray_to_rgb(png_ptr);
   png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
-  (void)png_set_interlace_handling(png_ptr);
+  scaler.passes = png_set_interlace_handling(png_ptr);
   png_read_update_info(png_ptr, info_ptr);
 }
 
+/* Decode-time downscaling: each scale x scale block of the canvas becomes one
+ * pixel. Rows are box-filtered as they arrive, weighted by alpha, so only one
+ * row of sums is kept. Interlaced frames are combined at full size first.
+ *
+ * A frame rect that is not aligned to the blocks covers its edge blocks only
+ * in part. The rest of such a block keeps the canvas: with blend source it is
+ * filled from the scaled canvas before filtering, with blend over it counts
+ * as transparent, so composing over the canvas gives the same block. Dispose
+ * to background starts from the canvas before the frame and clears the
+ * covered part of each block, by its weight in alpha.
+ */
+unsigned int scale_block(unsigned int b, unsigned int size)
+{
+  unsigned int end = (b + 1) * scale;
+  return ((end < size) ? end : size) - b * scale;
+}
+
+unsigned int scale_cover(unsigned int b, unsigned int pos, unsigned int len)
+{
+  unsigned int lo = (b * scale > pos) ? b * scale : pos;
+  unsigned int hi = ((b + 1) * scale < pos + len) ? (b + 1) * scale : pos + len;
+  return (hi > lo) ? hi - lo : 0;
+}
+
+void scale_start(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+  scaler.x = x;
+  scaler.y = y;
+  scaler.w = w;
+  scaler.h = h;
+  scaler.sx = x / scale;
+  scaler.sy = y / scale;
+  scaler.sw = (x + w + scale - 1) / scale - scaler.sx;
+  scaler.sh = (y + h + scale - 1) / scale - scaler.sy;
+  scaler.row = 0;
+  if (scaler.acc)
+    memset(scaler.acc, 0, scaler.sw * 5 * sizeof(unsigned int));
+}
+
+void scale_flush(APNGFrame * frame)
+{
+  unsigned int * sp = scaler.acc;
+  unsigned char * dp = frame->rows[scaler.row];
+  unsigned char * cp = scaler.canvas[scaler.sy + scaler.row] + scaler.sx * 4;
+  unsigned int bh = scale_block(scaler.sy + scaler.row, scaler.ch);
+
+  for (unsigned int i=0; i<scaler.sw; i++, sp+=5, dp+=4, cp+=4)
+  {
+    unsigned int total = scale_block(scaler.sx + i, scaler.cw) * bh;
+    if (sp[4] < total)
+    {
+      if (scaler.bop == 0)
+      {
+        unsigned int a = cp[3] * (total - sp[4]);
+        sp[0] += a;
+        sp[1] += cp[0] * a;
+        sp[2] += cp[1] * a;
+        sp[3] += cp[2] * a;
+      }
+      sp[4] = total;
+    }
+    if (sp[0] == 0)
+      dp[0] = dp[1] = dp[2] = dp[3] = 0;
+    else
+    {
+      dp[0] = (sp[1] + sp[0]/2) / sp[0];
+      dp[1] = (sp[2] + sp[0]/2) / sp[0];
+      dp[2] = (sp[3] + sp[0]/2) / sp[0];
+      dp[3] = (sp[0] + sp[4]/2) / sp[4];
+    }
+  }
+  memset(scaler.acc, 0, scaler.sw * 5 * sizeof(unsigned int));
+}
+
+void scale_row(APNGFrame * frame, unsigned char * row, unsigned int row_num)
+{
+  unsigned int i, a;
+  unsigned int r = (scaler.y + row_num) / scale - scaler.sy;
+
+  if (r != scaler.row)
+  {
+    scale_flush(frame);
+    scaler.row = r;
+  }
+
+  for (i=0; i<scaler.w; i++, row+=4)
+  {
+    unsigned int * dp = scaler.acc + ((scaler.x + i) / scale - scaler.sx) * 5;
+    a = row[3];
+    dp[0] += a;
+    dp[1] += row[0] * a;
+    dp[2] += row[1] * a;
+    dp[3] += row[2] * a;
+    dp[4]++;
+  }
+
+  if (row_num == scaler.h - 1)
+    scale_flush(frame);
+}
+
+void scale_finish(APNGFrame * frame)
+{
+  if (scale > 1 && scaler.passes > 1)
+    for (unsigned int j=0; j<scaler.h; j++)
+      scale_row(frame, scaler.rows[j], j);
+}
+
+void scale_dispose(png_bytep * rows)
+{
+  unsigned int i, j;
+
+  for (j=0; j<scaler.sh; j++)
+  {
+    unsigned char * dp = rows[scaler.sy + j] + scaler.sx * 4;
+    if (scale == 1)
+    {
+      memset(dp, 0, scaler.sw * 4);
+      continue;
+    }
+    unsigned int bh = scale_block(scaler.sy + j, scaler.ch);
+    unsigned int ch = scale_cover(scaler.sy + j, scaler.y, scaler.h);
+    for (i=0; i<scaler.sw; i++, dp+=4)
+    {
+      unsigned int total = scale_block(scaler.sx + i, scaler.cw) * bh;
+      unsigned int covered = scale_cover(scaler.sx + i, scaler.x, scaler.w) * ch;
+      if (covered == total)
+        dp[0] = dp[1] = dp[2] = dp[3] = 0;
+      else
+        dp[3] = (dp[3] * (total - covered) + total/2) / total;
+    }
+  }
+}
+
 void row_fn(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass)
 {
   APNGFrame * frame = (APNGFrame *)png_get_progressive_ptr(png_ptr);
-  png_progressive_combine_row(png_ptr, frame->rows[row_num], new_row);
+  if (scale == 1)
+    png_progressive_combine_row(png_ptr, frame->rows[row_num], new_row);
+  else
+  if (scaler.passes > 1)
+    png_progressive_combine_row(png_ptr, scaler.rows[row_num], new_row);
+  else
+  if (new_row != NULL)
+    scale_row(frame, new_row, row_num);
 }
 
 void compose_frame(unsigned char ** rows_dst, unsigned char ** rows_src, unsigned char bop, unsigned int x, unsigned int y, unsigned int w, unsigned int h)
@@ -140,7 +511,7 @@ int processing_start(png_structp & png_ptr, png_infop & info_ptr, void * frame_p
 {
   unsigned char header[8] = {137, 80, 78, 71, 13, 10, 26, 10};
 
-  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, (png_voidp)"libpng read", ALLOC_PNG_MALLOC, ALLOC_PNG_FREE);
   info_ptr = png_create_info_struct(png_ptr);
   if (!png_ptr || !info_ptr)
     return 1;
@@ -197,10 +568,22 @@ int processing_finish(png_structp png_ptr, png_infop info_ptr)
   return 0;
 }
 
+// --stats and --trace: frame was decoded from t_frame to t_compose and composed onto the canvas after that.
+void frame_loaded(int frame, unsigned int x0, unsigned int y0, unsigned int w0, unsigned int h0,
+                  std::chrono::steady_clock::time_point t_frame, std::chrono::steady_clock::time_point t_compose)
+{
+  std::chrono::steady_clock::time_point t_done = std::chrono::steady_clock::now();
+
+  stats_record("load_frames", "\"frame\": %d, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, \"decode_ms\": %.3f, \"compose_ms\": %.3f",
+               frame, x0, y0, w0, h0, ms_between(t_frame, t_compose), ms_between(t_compose, t_done));
+  trace_complete("decode", t_frame, t_compose, frame);
+  trace_complete("compose", t_compose, t_done, frame);
+}
+
 int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first, unsigned int & loops)
 {
   FILE * f;
-  unsigned int id, i, j, w, h, w0, h0, x0, y0;
+  unsigned int id, i, j, w, h, sw, sh, w0, h0, x0, y0;
   unsigned int delay_num, delay_den, dop, bop, rowbytes, imagesize;
   unsigned char sig[8];
   png_structp png_ptr;
@@ -210,15 +593,19 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
   std::vector<CHUNK> chunksInfo;
   bool isAnimated = false;
   bool hasInfo = false;
+  bool overrun = false;
   APNGFrame frameRaw = {0};
   APNGFrame frameCur = {0};
   APNGFrame frameNext = {0};
+  unsigned int num_loaded = 0;
   int res = -1;
+  std::chrono::steady_clock::time_point t_frame = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point t_compose;
   first = 0;
 
   printf("Reading '%s'...\n", szIn);
 
-  if ((f = fopen(szIn, "rb")) != 0)
+  if ((f = pipe_open_in(szIn, false)) != 0)
   {
     if (fread(sig, 1, 8, f) == 8 && png_sig_cmp(sig, 0, 8) == 0)
     {
@@ -241,22 +628,46 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
         delay_den = 10;
         dop = 0;
         bop = 0;
-        rowbytes = w * 4;
-        imagesize = h * rowbytes;
+        sw = (w + scale - 1) / scale;
+        sh = (h + scale - 1) / scale;
+        rowbytes = sw * 4;
+        imagesize = sh * rowbytes;
 
         frameRaw.p = new unsigned char[imagesize];
-        frameRaw.rows = new png_bytep[h * sizeof(png_bytep)];
-        for (j=0; j<h; j++)
+        frameRaw.rows = new png_bytep[sh];
+        for (j=0; j<sh; j++)
           frameRaw.rows[j] = frameRaw.p + j * rowbytes;
 
+        scaler.acc = NULL;
+        scaler.rows = NULL;
+        scaler.passes = 1;
+        scaler.cw = w;
+        scaler.ch = h;
+        if (scale > 1)
+        {
+          scaler.acc = new unsigned int[sw * 5];
+          scaler.rows = new png_bytep[h];
+          scaler.rows[0] = NULL;
+          if (chunkIHDR.p[20] != 0)
+          {
+            // interlaced frames are combined at full size before scaling
+            scaler.rows[0] = new unsigned char[h * w * 4];
+            for (j=1; j<h; j++)
+              scaler.rows[j] = scaler.rows[0] + j * w * 4;
+          }
+        }
+        scale_start(x0, y0, w0, h0);
+
         if (!processing_start(png_ptr, info_ptr, (void *)&frameRaw, hasInfo, chunkIHDR, chunksInfo))
         {
-          frameCur.w = w;
-          frameCur.h = h;
-          frameCur.p = new unsigned char[imagesize];
-          frameCur.rows = new png_bytep[h * sizeof(png_bytep)];
-          for (j=0; j<h; j++)
+          frameCur.w = sw;
+          frameCur.h = sh;
+          frameCur.p = canvas_alloc(imagesize);
+          frameCur.rows = new png_bytep[sh];
+          for (j=0; j<sh; j++)
             frameCur.rows[j] = frameCur.p + j * rowbytes;
+          scaler.canvas = frameCur.rows;
+          scaler.bop = bop;
 
           while ( !feof(f) )
           {
@@ -277,46 +688,66 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
               {
                 if (!processing_finish(png_ptr, info_ptr))
                 {
-                  frameNext.p = new unsigned char[imagesize];
-                  frameNext.rows = new png_bytep[h * sizeof(png_bytep)];
-                  for (j=0; j<h; j++)
+                  t_compose = std::chrono::steady_clock::now();
+                  if ((frameNext.p = canvas_alloc(imagesize)) == NULL)
+                  {
+                    printf("Error: more frames than counted for the memory budget\n");
+                    delete[] frameCur.rows;
+                    canvas_free(frameCur.p);
+                    delete[] chunk.p;
+                    overrun = true;
+                    break;
+                  }
+                  frameNext.rows = new png_bytep[sh];
+                  for (j=0; j<sh; j++)
                     frameNext.rows[j] = frameNext.p + j * rowbytes;
 
-                  if (dop == 2)
+                  if (dop != 0)
                     memcpy(frameNext.p, frameCur.p, imagesize);
 
-                  compose_frame(frameCur.rows, frameRaw.rows, bop, x0, y0, w0, h0);
+                  scale_finish(&frameRaw);
+                  compose_frame(frameCur.rows, frameRaw.rows, bop, scaler.sx, scaler.sy, scaler.sw, scaler.sh);
                   frameCur.delay_num = delay_num;
                   frameCur.delay_den = delay_den;
 
-                  frames.push_back(frameCur);
-
-                  if (dop != 2)
-                  {
+                  if (dop == 0)
                     memcpy(frameNext.p, frameCur.p, imagesize);
-                    if (dop == 1)
-                      for (j=0; j<h0; j++)
-                        memset(frameNext.rows[y0 + j] + x0*4, 0, w0*4);
-                  }
+                  else
+                  if (dop == 1)
+                    scale_dispose(frameNext.rows);
+
+                  frame_loaded(num_loaded-first+1, x0, y0, w0, h0, t_frame, t_compose);
+
+                  // with frame_fn the frame may be changed by another thread from here on
+                  if (frame_fn)
+                    frame_fn(frameCur);
+                  else
+                    frames.push_back(frameCur);
+                  num_loaded++;
+                  spill_touch();
+
                   frameCur.p = frameNext.p;
                   frameCur.rows = frameNext.rows;
                 }
                 else
                 {
                   delete[] frameCur.rows;
-                  delete[] frameCur.p;
+                  canvas_free(frameCur.p);
                   delete[] chunk.p;
                   break;
                 }
               }
 
               // At this point the old frame is done. Let's start a new one.
+              t_frame = std::chrono::steady_clock::now();
               w0 = png_get_uint_32(chunk.p + 12);
               h0 = png_get_uint_32(chunk.p + 16);
               x0 = png_get_uint_32(chunk.p + 20);
               y0 = png_get_uint_32(chunk.p + 24);
               delay_num = png_get_uint_16(chunk.p + 28);
               delay_den = png_get_uint_16(chunk.p + 30);
+              if (delay_den == 0)
+                delay_den = 100;
               dop = chunk.p[32];
               bop = chunk.p[33];
 
@@ -324,18 +755,20 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
                   || x0 + w0 > w || y0 + h0 > h || dop > 2 || bop > 1)
               {
                 delete[] frameCur.rows;
-                delete[] frameCur.p;
+                canvas_free(frameCur.p);
                 delete[] chunk.p;
                 break;
               }
 
+              scale_start(x0, y0, w0, h0);
+
               if (hasInfo)
               {
                 memcpy(chunkIHDR.p + 8, chunk.p + 12, 8);
                 if (processing_start(png_ptr, info_ptr, (void *)&frameRaw, hasInfo, chunkIHDR, chunksInfo))
                 {
                   delete[] frameCur.rows;
-                  delete[] frameCur.p;
+                  canvas_free(frameCur.p);
                   delete[] chunk.p;
                   break;
                 }
@@ -343,12 +776,14 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
               else
                 first = 0;
 
-              if (frames.size() == first)
+              if (num_loaded == first)
               {
                 bop = 0;
                 if (dop == 2)
                   dop = 1;
               }
+              scaler.canvas = frameCur.rows;
+              scaler.bop = bop;
             }
             else
             if (id == id_IDAT)
@@ -357,7 +792,7 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
               if (processing_data(png_ptr, info_ptr, chunk.p, chunk.size))
               {
                 delete[] frameCur.rows;
-                delete[] frameCur.p;
+                canvas_free(frameCur.p);
                 delete[] chunk.p;
                 break;
               }
@@ -370,7 +805,7 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
               if (processing_data(png_ptr, info_ptr, chunk.p + 4, chunk.size - 4))
               {
                 delete[] frameCur.rows;
-                delete[] frameCur.p;
+                canvas_free(frameCur.p);
                 delete[] chunk.p;
                 break;
               }
@@ -380,15 +815,22 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
             {
               if (hasInfo && !processing_finish(png_ptr, info_ptr))
               {
-                compose_frame(frameCur.rows, frameRaw.rows, bop, x0, y0, w0, h0);
+                t_compose = std::chrono::steady_clock::now();
+                scale_finish(&frameRaw);
+                compose_frame(frameCur.rows, frameRaw.rows, bop, scaler.sx, scaler.sy, scaler.sw, scaler.sh);
                 frameCur.delay_num = delay_num;
                 frameCur.delay_den = delay_den;
-                frames.push_back(frameCur);
+                frame_loaded(num_loaded-first+1, x0, y0, w0, h0, t_frame, t_compose);
+                if (frame_fn)
+                  frame_fn(frameCur);
+                else
+                  frames.push_back(frameCur);
+                num_loaded++;
               }
               else
               {
                 delete[] frameCur.rows;
-                delete[] frameCur.p;
+                canvas_free(frameCur.p);
               }
               delete[] chunk.p;
               break;
@@ -405,7 +847,7 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
               if (processing_data(png_ptr, info_ptr, chunk.p, chunk.size))
               {
                 delete[] frameCur.rows;
-                delete[] frameCur.p;
+                canvas_free(frameCur.p);
                 delete[] chunk.p;
                 break;
               }
@@ -417,8 +859,14 @@ int load_apng(char * szIn, std::vector<APNGFrame>& frames, unsigned int & first,
         }
         delete[] frameRaw.rows;
         delete[] frameRaw.p;
+        if (scale > 1)
+        {
+          delete[] scaler.rows[0];
+          delete[] scaler.rows;
+          delete[] scaler.acc;
+        }
 
-        if (!frames.empty())
+        if (num_loaded && !overrun)
           res = 0;
       }
 
@@ -443,6 +891,7 @@ void optim_dirty(std::vector<APNGFrame>& frames)
 
   for (i=0; i<frames.size(); i++)
   {
+    spill_touch();
     sp = frames[i].p;
     for (j=0; j<size; j++, sp+=4)
       if (sp[3] == 0)
@@ -450,6 +899,103 @@ void optim_dirty(std::vector<APNGFrame>& frames)
   }
 }
 
+/* Shrinks the canvas to the union of the non-transparent pixels of all
+ * frames. The top left corner is aligned on a 2 pixel boundary, like frame
+ * rects in get_rect(). Returns the offset of the new canvas.
+ */
+void optim_crop(std::vector<APNGFrame>& frames, unsigned int & x0, unsigned int & y0)
+{
+  unsigned int i, j, k;
+  unsigned int w = frames[0].w;
+  unsigned int h = frames[0].h;
+  unsigned int x_min = w;
+  unsigned int y_min = h;
+  unsigned int x_max = 0;
+  unsigned int y_max = 0;
+
+  for (i=0; i<frames.size(); i++)
+  {
+    spill_touch();
+    for (j=0; j<h; j++)
+    {
+      unsigned char * sp = frames[i].rows[j] + 3;
+      for (k=0; k<w; k++, sp+=4)
+        if (*sp != 0)
+        {
+          if (k<x_min) x_min = k;
+          if (k>x_max) x_max = k;
+          if (j<y_min) y_min = j;
+          if (j>y_max) y_max = j;
+        }
+    }
+  }
+
+  if (x_min > x_max)
+    x_min = y_min = x_max = y_max = 0;
+
+  x0 = x_min & ~1U;
+  y0 = y_min & ~1U;
+  unsigned int w0 = x_max - x0 + 1;
+  unsigned int h0 = y_max - y0 + 1;
+
+  if (w0 == w && h0 == h)
+    return;
+
+  for (i=0; i<frames.size(); i++)
+  {
+    spill_touch();
+    for (j=0; j<h0; j++)
+    {
+      unsigned char * dp = frames[i].p + j * w0 * 4;
+      memmove(dp, frames[i].rows[y0 + j] + x0 * 4, w0 * 4);
+      frames[i].rows[j] = dp;
+    }
+    frames[i].w = w0;
+    frames[i].h = h0;
+  }
+  printf("cropped canvas to %dx%d at %d,%d\n", w0, h0, x0, y0);
+}
+
+void merge_delay(APNGFrame & frame, unsigned int num, unsigned int den)
+{
+  unsigned long long sum_num, sum_den, a, b;
+
+  if (frame.delay_den == den)
+  {
+    sum_num = (unsigned long long)frame.delay_num + num;
+    sum_den = den;
+  }
+  else
+  {
+    sum_num = a = (unsigned long long)num*frame.delay_den + (unsigned long long)den*frame.delay_num;
+    sum_den = b = (unsigned long long)den*frame.delay_den;
+    while (a && b)
+    {
+      if (a > b)
+        a = a % b;
+      else
+        b = b % a;
+    }
+    a += b;
+    sum_num /= a;
+    sum_den /= a;
+  }
+
+  // fcTL has 16 bits for both, mixed denominators can need more: keep the closest delay that fits
+  if (sum_num > 0xFFFF || sum_den > 0xFFFF)
+  {
+    double delay = (double)sum_num / sum_den;
+    sum_den = (delay > 1.0) ? (unsigned long long)(0xFFFF / delay) : 0xFFFF;
+    if (sum_den == 0)
+      sum_den = 1;
+    sum_num = (unsigned long long)(delay * sum_den + 0.5);
+    if (sum_num > 0xFFFF)
+      sum_num = 0xFFFF;
+  }
+  frame.delay_num = (unsigned int)sum_num;
+  frame.delay_den = (unsigned int)sum_den;
+}
+
 void optim_duplicates(std::vector<APNGFrame>& frames, unsigned int first)
 {
   unsigned int imagesize = frames[0].w * frames[0].h * 4;
@@ -457,34 +1003,91 @@ void optim_duplicates(std::vector<APNGFrame>& frames, unsigned int first)
 
   while (++i < frames.size())
   {
+    spill_touch();
     if (memcmp(frames[i-1].p, frames[i].p, imagesize) != 0)
       continue;
 
     i--;
-    delete[] frames[i].p;
+    canvas_free(frames[i].p);
     delete[] frames[i].rows;
     unsigned int num = frames[i].delay_num;
     unsigned int den = frames[i].delay_den;
     frames.erase(frames.begin() + i);
+    merge_delay(frames[i], num, den);
+  }
+}
 
-    if (frames[i].delay_den == den)
-      frames[i].delay_num += num;
-    else
+/* Lossy version of optim_duplicates(). A frame is merged into the frame
+ * before it when at most max_changed pixels have a channel that differs by
+ * more than tolerance. The earlier frame is kept, and stays the reference
+ * for the frames after it, so the error stays within the tolerance, except
+ * for up to max_changed pixels (--merge-fraction) that may differ by any
+ * amount.
+ */
+void optim_near_duplicates(std::vector<APNGFrame>& frames, unsigned int first, unsigned int tolerance, unsigned int max_changed)
+{
+  unsigned int size = frames[0].w * frames[0].h;
+  unsigned int i = first;
+
+  while (++i < frames.size())
+  {
+    spill_touch();
+    unsigned char * pa = frames[i-1].p;
+    unsigned char * pb = frames[i].p;
+    unsigned int changed = 0;
+
+    for (unsigned int j=0; j<size && changed<=max_changed; j++, pa+=4, pb+=4)
+      if ((unsigned int)abs(pa[0]-pb[0]) > tolerance || (unsigned int)abs(pa[1]-pb[1]) > tolerance ||
+          (unsigned int)abs(pa[2]-pb[2]) > tolerance || (unsigned int)abs(pa[3]-pb[3]) > tolerance)
+        changed++;
+
+    if (changed > max_changed)
+      continue;
+
+    merge_delay(frames[i-1], frames[i].delay_num, frames[i].delay_den);
+    canvas_free(frames[i].p);
+    delete[] frames[i].rows;
+    frames.erase(frames.begin() + i);
+    i--;
+  }
+}
+
+/* Drops frames that start less than 1/max_fps seconds after the last kept
+ * frame. The delay of a dropped frame is added to the kept frame before it,
+ * so the total duration stays the same and the kept frames keep their start
+ * times.
+ */
+void optim_max_fps(std::vector<APNGFrame>& frames, unsigned int first, unsigned int max_fps)
+{
+  unsigned int i = first;
+  unsigned int dropped = 0;
+  double kept_start = 0;
+  double start;
+
+  // only the default image, or a single frame
+  if (frames.size() <= first + 1)
+    return;
+  start = (double)frames[first].delay_num / frames[first].delay_den;
+
+  while (++i < frames.size())
+  {
+    if ((start - kept_start) * max_fps >= 1.0 - 1e-9)
     {
-      frames[i].delay_num = num = num*frames[i].delay_den + den*frames[i].delay_num;
-      frames[i].delay_den = den = den*frames[i].delay_den;
-      while (num && den)
-      {
-        if (num > den)
-          num = num % den;
-        else
-          den = den % num;
-      }
-      num += den;
-      frames[i].delay_num /= num;
-      frames[i].delay_den /= num;
+      kept_start = start;
+      start += (double)frames[i].delay_num / frames[i].delay_den;
+      continue;
     }
+
+    start += (double)frames[i].delay_num / frames[i].delay_den;
+    merge_delay(frames[i-1], frames[i].delay_num, frames[i].delay_den);
+    canvas_free(frames[i].p);
+    delete[] frames[i].rows;
+    frames.erase(frames.begin() + i);
+    i--;
+    dropped++;
   }
+  if (dropped)
+    printf("dropped %d frames to stay under %d fps\n", dropped, max_fps);
 }
 
 /* APNG encoder - begin */
@@ -535,6 +1138,7 @@ void optim_downconvert(std::vector<APNGFrame>& frames, unsigned int & coltype)
 
   for (i=0; i<num_frames; i++)
   {
+    spill_touch();
     sp = frames[i].p;
     for (j=0; j<size; j++)
     {
@@ -600,6 +1204,7 @@ void optim_downconvert(std::vector<APNGFrame>& frames, unsigned int & coltype)
 
     for (i=0; i<num_frames; i++)
     {
+      spill_touch();
       sp = dp = frames[i].p;
       for (j=0; j<size; j++, sp+=4)
       {
@@ -632,6 +1237,7 @@ void optim_downconvert(std::vector<APNGFrame>& frames, unsigned int & coltype)
 
     for (i=0; i<num_frames; i++)
     {
+      spill_touch();
       sp = dp = frames[i].p;
       for (j=0; j<size; j++)
       {
@@ -652,6 +1258,7 @@ void optim_downconvert(std::vector<APNGFrame>& frames, unsigned int & coltype)
     coltype = 4;
     for (i=0; i<num_frames; i++)
     {
+      spill_touch();
       sp = dp = frames[i].p;
       for (j=0; j<size; j++, sp+=4)
       {
@@ -680,6 +1287,7 @@ void optim_downconvert(std::vector<APNGFrame>& frames, unsigned int & coltype)
       coltype = 2;
       for (i=0; i<num_frames; i++)
       {
+        spill_touch();
         sp = dp = frames[i].p;
         for (j=0; j<size; j++)
         {
@@ -696,6 +1304,7 @@ void optim_downconvert(std::vector<APNGFrame>& frames, unsigned int & coltype)
       coltype = 2;
       for (i=0; i<num_frames; i++)
       {
+        spill_touch();
         sp = dp = frames[i].p;
         for (j=0; j<size; j++)
         {
@@ -749,6 +1358,22 @@ void write_chunk(FILE * f, const char * name, unsigned char * data, unsigned int
   fwrite(buf, 1, 4, f);
 }
 
+void write_fcTL(FILE * f, unsigned int w, unsigned int h, unsigned int x, unsigned int y, unsigned int delay_num, unsigned int delay_den, unsigned int dop, unsigned int bop)
+{
+  unsigned char buf_fcTL[26];
+
+  png_save_uint_32(buf_fcTL, next_seq_num++);
+  png_save_uint_32(buf_fcTL + 4, w);
+  png_save_uint_32(buf_fcTL + 8, h);
+  png_save_uint_32(buf_fcTL + 12, x);
+  png_save_uint_32(buf_fcTL + 16, y);
+  png_save_uint_16(buf_fcTL + 20, delay_num);
+  png_save_uint_16(buf_fcTL + 22, delay_den);
+  buf_fcTL[24] = dop;
+  buf_fcTL[25] = bop;
+  write_chunk(f, "fcTL", buf_fcTL, 26);
+}
+
 void write_IDATs(FILE * f, int frame, unsigned char * data, unsigned int length, unsigned int idat_size)
 {
   unsigned int z_cmf = data[0];
@@ -936,12 +1561,13 @@ void deflate_rect_fin(unsigned char * zbuf, unsigned int * zsize, int bpp, int s
     process_rect(row, rowbytes, bpp, stride, op[n].h, rows);
 
   z_stream fin_zstream;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
 
   fin_zstream.data_type = Z_BINARY;
-  fin_zstream.zalloc = Z_NULL;
-  fin_zstream.zfree = Z_NULL;
-  fin_zstream.opaque = Z_NULL;
-  deflateInit2(&fin_zstream, Z_BEST_COMPRESSION, 8, 15, 8, op[n].filters ? Z_FILTERED : Z_DEFAULT_STRATEGY);
+  fin_zstream.zalloc = ALLOC_ZALLOC;
+  fin_zstream.zfree = ALLOC_ZFREE;
+  fin_zstream.opaque = (voidpf)"fin_zstream";
+  deflateInit2(&fin_zstream, fin_level, 8, 15, 8, op[n].filters ? Z_FILTERED : Z_DEFAULT_STRATEGY);
 
   fin_zstream.next_out = zbuf;
   fin_zstream.avail_out = zbuf_size;
@@ -950,6 +1576,58 @@ void deflate_rect_fin(unsigned char * zbuf, unsigned int * zsize, int bpp, int s
   deflate(&fin_zstream, Z_FINISH);
   *zsize = fin_zstream.total_out;
   deflateEnd(&fin_zstream);
+
+  if (deadline.ms)
+  {
+    double px = (double)op[n].w * op[n].h;
+    int k = 0;
+    while (k < 2 && cFinLevels[k] != fin_level)
+      k++;
+    deadline.fin_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    deadline.fin_px += px * cFinCost[k];
+    deadline.rect_px += px;
+    deadline.rects++;
+  }
+}
+
+/* Picks the deflate level of the next frame for --deadline-ms. The time per
+ * pixel measured so far projects how long the rest takes: this frame's rect,
+ * plus the average rect for each frame left, plus the rect search for them.
+ * The highest level that still ends before the deadline is used.
+ */
+int pick_fin_level(unsigned int rect_px, unsigned int canvas_px, unsigned int frames_left)
+{
+  double elapsed = ms_since(deadline.start);
+  double fin_rate, other_rate, rect_avg;
+  int k;
+
+  if (deadline.rects == 0)
+    return (elapsed < deadline.ms) ? cFinLevels[0] : cFinLevels[2];
+
+  fin_rate = deadline.fin_ms / deadline.fin_px;
+  other_rate = 0;
+  if (deadline.frames)
+    other_rate = (ms_since(deadline.save_start) - deadline.fin_ms) / ((double)deadline.frames * canvas_px);
+  rect_avg = deadline.rect_px / deadline.rects;
+
+  for (k=0; k<2; k++)
+    if (elapsed + frames_left*(canvas_px*other_rate + rect_avg*fin_rate*cFinCost[k]) + rect_px*fin_rate*cFinCost[k] <= deadline.ms)
+      break;
+  return cFinLevels[k];
+}
+
+void set_fin_level(int frame, unsigned int rect_px, unsigned int canvas_px, unsigned int frames_left)
+{
+  if (!deadline.ms)
+    return;
+
+  fin_level = pick_fin_level(rect_px, canvas_px, frames_left);
+  if (fin_level != Z_BEST_COMPRESSION)
+  {
+    // also with --quiet, apng2webp passes these lines on
+    printf("frame %d: deflate level %d to meet the deadline\n", frame, fin_level);
+    deadline.reduced++;
+  }
 }
 
 void deflate_rect_op(unsigned char *pdata, int x, int y, int w, int h, int bpp, int stride, int zbuf_size, int n)
@@ -1141,29 +1819,373 @@ void get_rect(unsigned int w, unsigned int h, unsigned char *pimage1, unsigned c
     deflate_rect_op(ptemp, x0, y0, w0, h0, bpp, stride, zbuf_size, n*2+1);
 }
 
-int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first, unsigned int loops, unsigned int coltype)
+/* Lossy: pixels of the next frame that are within threshold of the previous
+ * canvas are replaced by the previous pixel. get_rect() then sees them as
+ * unchanged, so they are left out of the rect and are transparent in the
+ * over-image. The next frame is compared to what is really displayed, so
+ * errors do not build up over frames.
+ */
+void snap_near_pixels(unsigned int w, unsigned int h, unsigned char *pimage1, unsigned char *pimage2, unsigned int bpp, unsigned int coltype, unsigned int has_tcolor, unsigned int tcolor, unsigned int threshold)
 {
-  FILE * f;
-  unsigned int i, j, k;
-  unsigned int x0, y0, w0, h0, dop, bop;
-  unsigned int idat_size, zbuf_size, zsize;
-  unsigned char * zbuf;
-  unsigned char header[8] = {137, 80, 78, 71, 13, 10, 26, 10};
-  unsigned int num_frames = frames.size();
-  unsigned int width = frames[0].w;
-  unsigned int height = frames[0].h;
-  unsigned int bpp = (coltype == 6) ? 4 : (coltype == 2) ? 3 : (coltype == 4) ? 2 : 1;
-  unsigned int has_tcolor = (coltype >= 4 || (coltype <= 2 && trnssize)) ? 1 : 0;
-  unsigned int tcolor = 0;
-  unsigned int rowbytes  = width * bpp;
-  unsigned int imagesize = rowbytes * height;
+  unsigned int i, k, size = w * h;
+  unsigned char *pa = pimage1;
+  unsigned char *pb = pimage2;
 
-  unsigned char * temp  = new unsigned char[imagesize];
-  unsigned char * over1 = new unsigned char[imagesize];
-  unsigned char * over2 = new unsigned char[imagesize];
-  unsigned char * over3 = new unsigned char[imagesize];
-  unsigned char * rest  = new unsigned char[imagesize];
-  unsigned char * rows  = new unsigned char[(rowbytes + 1) * height];
+  for (i=0; i<size; i++, pa+=bpp, pb+=bpp)
+  {
+    if (memcmp(pa, pb, bpp) == 0)
+      continue;
+
+    int near = 1;
+    if (coltype == 3)
+    {
+      if ((unsigned int)abs(palette[*pa].r - palette[*pb].r) > threshold ||
+          (unsigned int)abs(palette[*pa].g - palette[*pb].g) > threshold ||
+          (unsigned int)abs(palette[*pa].b - palette[*pb].b) > threshold ||
+          (unsigned int)abs(trns[*pa] - trns[*pb]) > threshold)
+        near = 0;
+    }
+    else
+    {
+      if (has_tcolor && (coltype == 0 || coltype == 2))
+      {
+        // the transparent colour key can't be approximated
+        unsigned int c1 = 0, c2 = 0;
+        memcpy(&c1, pa, bpp);
+        memcpy(&c2, pb, bpp);
+        if (c1 == tcolor || c2 == tcolor)
+          near = 0;
+      }
+      for (k=0; k<bpp && near; k++)
+        if ((unsigned int)abs(pa[k] - pb[k]) > threshold)
+          near = 0;
+    }
+
+    if (near)
+      memcpy(pb, pa, bpp);
+  }
+}
+
+/* Finds clusters of changed pixels on a grid of cSplitTile x cSplitTile tiles.
+ * Touching dirty tiles form one cluster. Each cluster gives the bounding box
+ * of its changed pixels, aligned like in get_rect(). Overlapping boxes are
+ * joined.
+ */
+void find_clusters(unsigned int w, unsigned int h, unsigned char *pimage1, unsigned char *pimage2, unsigned int bpp, std::vector<RECT>& rects)
+{
+  unsigned int i, j, k;
+  unsigned int tw = (w + cSplitTile - 1) / cSplitTile;
+  unsigned int th = (h + cSplitTile - 1) / cSplitTile;
+  std::vector<RECT> tiles(tw * th);
+  std::vector<int> label(tw * th, -1);
+  std::vector<unsigned int> stack;
+  unsigned char *pa = pimage1;
+  unsigned char *pb = pimage2;
+
+  for (k=0; k<tw*th; k++)
+    tiles[k].w = 0;
+
+  for (j=0; j<h; j++)
+  for (i=0; i<w; i++, pa+=bpp, pb+=bpp)
+  {
+    if (memcmp(pa, pb, bpp) == 0)
+      continue;
+    if ((bpp == 4 && pa[3] == 0 && pb[3] == 0) || (bpp == 2 && pa[1] == 0 && pb[1] == 0))
+      continue;
+
+    // tile rects hold x_min, y_min, x_max + 1, y_max + 1 while scanning
+    RECT & t = tiles[(j / cSplitTile) * tw + i / cSplitTile];
+    if (t.w == 0)
+    {
+      t.x = i;
+      t.y = j;
+      t.w = i+1;
+      t.h = j+1;
+    }
+    else
+    {
+      if (i<t.x) t.x = i;
+      if (i+1>t.w) t.w = i+1;
+      t.h = j+1;
+    }
+  }
+
+  rects.clear();
+  for (k=0; k<tw*th; k++)
+  {
+    if (tiles[k].w == 0 || label[k] >= 0)
+      continue;
+
+    RECT r = tiles[k];
+    label[k] = rects.size();
+    stack.push_back(k);
+    while (!stack.empty())
+    {
+      unsigned int t = stack.back();
+      unsigned int tx = t % tw;
+      unsigned int ty = t / tw;
+      stack.pop_back();
+
+      for (j=(ty ? ty-1 : 0); j<=ty+1 && j<th; j++)
+      for (i=(tx ? tx-1 : 0); i<=tx+1 && i<tw; i++)
+      {
+        unsigned int n = j * tw + i;
+        if (tiles[n].w == 0 || label[n] >= 0)
+          continue;
+        label[n] = label[k];
+        if (tiles[n].x < r.x) r.x = tiles[n].x;
+        if (tiles[n].y < r.y) r.y = tiles[n].y;
+        if (tiles[n].w > r.w) r.w = tiles[n].w;
+        if (tiles[n].h > r.h) r.h = tiles[n].h;
+        stack.push_back(n);
+      }
+    }
+    r.x &= ~1U;
+    r.y &= ~1U;
+    rects.push_back(r);
+  }
+
+  int joined = 1;
+  while (joined)
+  {
+    joined = 0;
+    for (i=0; i<rects.size() && !joined; i++)
+    for (j=i+1; j<rects.size() && !joined; j++)
+    {
+      if (rects[i].x < rects[j].w && rects[j].x < rects[i].w && rects[i].y < rects[j].h && rects[j].y < rects[i].h)
+      {
+        if (rects[j].x < rects[i].x) rects[i].x = rects[j].x;
+        if (rects[j].y < rects[i].y) rects[i].y = rects[j].y;
+        if (rects[j].w > rects[i].w) rects[i].w = rects[j].w;
+        if (rects[j].h > rects[i].h) rects[i].h = rects[j].h;
+        rects.erase(rects.begin() + j);
+        joined = 1;
+      }
+    }
+  }
+
+  for (k=0; k<rects.size(); k++)
+  {
+    rects[k].w -= rects[k].x;
+    rects[k].h -= rects[k].y;
+  }
+}
+
+/* Area of the bounding box of the pixels that differ between two frames. */
+unsigned int changed_area(unsigned int w, unsigned int h, unsigned char *pimage1, unsigned char *pimage2, unsigned int bpp)
+{
+  unsigned int i, j;
+  unsigned int x_min = w, y_min = h, x_max = 0, y_max = 0;
+  unsigned char *pa = pimage1;
+  unsigned char *pb = pimage2;
+
+  for (j=0; j<h; j++)
+  for (i=0; i<w; i++, pa+=bpp, pb+=bpp)
+  {
+    if (memcmp(pa, pb, bpp) == 0)
+      continue;
+    if (i<x_min) x_min = i;
+    if (i>x_max) x_max = i;
+    if (j<y_min) y_min = j;
+    if (j>y_max) y_max = j;
+  }
+  return (x_min < w) ? (x_max-x_min+1)*(y_max-y_min+1) : 0;
+}
+
+/* Picks the frames that --kmin/--kmax turn into key frames: full canvas with
+ * blend op SOURCE, so a decoder can start there. Key frames are kmin to kmax
+ * frames apart. In each window the frame whose changed rect is largest is
+ * picked, as it costs the least to write in full.
+ */
+void plan_key_frames(std::vector<APNGFrame>& frames, unsigned int first, unsigned int bpp, std::vector<unsigned char>& key)
+{
+  unsigned int i, best;
+  unsigned int n = frames.size();
+  unsigned int last = first;
+  unsigned int canvas = frames[0].w * frames[0].h;
+  std::vector<unsigned int> penalty(n, 0);
+
+  key.assign(n, 0);
+  for (i=first+1; i<n; i++)
+  {
+    spill_touch();
+    penalty[i] = canvas - changed_area(frames[0].w, frames[0].h, frames[i-1].p, frames[i].p, bpp);
+  }
+
+  while (n - 1 - last >= kmax)
+  {
+    best = last + kmin;
+    for (i=last+kmin+1; i<=last+kmax; i++)
+      if (penalty[i] <= penalty[best])
+        best = i;
+    key[best] = 1;
+    last = best;
+  }
+}
+
+/* Fills op[] with the rects for the next frame: op[0..1] when the previous
+ * frame is kept (dispose none), op[2..3] when its rect x0,y0,w0,h0 is
+ * cleared to the transparent color first (dispose background).
+ */
+void get_rects(unsigned int width, unsigned int height, unsigned char *prev, unsigned char *cur, unsigned char *temp, unsigned char *over1, unsigned char *over2,
+               unsigned int bpp, unsigned int rowbytes, int zbuf_size, unsigned int coltype, unsigned int has_tcolor, unsigned int tcolor,
+               unsigned int x0, unsigned int y0, unsigned int w0, unsigned int h0)
+{
+  unsigned int j, k;
+
+  /* dispose = none */
+  get_rect(width, height, prev, cur, over1, bpp, rowbytes, zbuf_size, has_tcolor, tcolor, 0);
+
+  /* dispose = background */
+  if (has_tcolor)
+  {
+    memcpy(temp, prev, rowbytes * height);
+    if (coltype == 2)
+      for (j=0; j<h0; j++)
+        for (k=0; k<w0; k++)
+          memcpy(temp + ((j+y0)*width + (k+x0))*3, &tcolor, 3);
+    else
+      for (j=0; j<h0; j++)
+        memset(temp + ((j+y0)*width + x0)*bpp, tcolor, w0*bpp);
+
+    get_rect(width, height, temp, cur, over2, bpp, rowbytes, zbuf_size, has_tcolor, tcolor, 1);
+  }
+}
+
+int best_op()
+{
+  unsigned int j;
+  unsigned int op_min = op[0].size;
+  int op_best = 0;
+
+  for (j=1; j<6; j++)
+  if (op[j].valid)
+  {
+    if (op[j].size < op_min)
+    {
+      op_min = op[j].size;
+      op_best = j;
+    }
+  }
+  return op_best;
+}
+
+// The rows of the five filter types, for process_rect(). Per thread, like op[].
+void filter_init(unsigned int rowbytes)
+{
+  row_buf = new unsigned char[rowbytes + 1];
+  sub_row = new unsigned char[rowbytes + 1];
+  up_row = new unsigned char[rowbytes + 1];
+  avg_row = new unsigned char[rowbytes + 1];
+  paeth_row = new unsigned char[rowbytes + 1];
+
+  row_buf[0] = 0;
+  sub_row[0] = 1;
+  up_row[0] = 2;
+  avg_row[0] = 3;
+  paeth_row[0] = 4;
+}
+
+void filter_free()
+{
+  delete[] row_buf;
+  delete[] sub_row;
+  delete[] up_row;
+  delete[] avg_row;
+  delete[] paeth_row;
+}
+
+void op_init(unsigned int rowbytes, unsigned int zbuf_size)
+{
+  op_zstream1.data_type = Z_BINARY;
+  op_zstream1.zalloc = ALLOC_ZALLOC;
+  op_zstream1.zfree = ALLOC_ZFREE;
+  op_zstream1.opaque = (voidpf)"op_zstream1";
+  deflateInit2(&op_zstream1, Z_BEST_SPEED+1, 8, 15, 8, Z_DEFAULT_STRATEGY);
+
+  op_zstream2.data_type = Z_BINARY;
+  op_zstream2.zalloc = ALLOC_ZALLOC;
+  op_zstream2.zfree = ALLOC_ZFREE;
+  op_zstream2.opaque = (voidpf)"op_zstream2";
+  deflateInit2(&op_zstream2, Z_BEST_SPEED+1, 8, 15, 8, Z_FILTERED);
+
+  op_zbuf1 = new unsigned char[zbuf_size];
+  op_zbuf2 = new unsigned char[zbuf_size];
+  filter_init(rowbytes);
+}
+
+void op_free()
+{
+  delete[] op_zbuf1;
+  delete[] op_zbuf2;
+  filter_free();
+
+  deflateEnd(&op_zstream1);
+  deflateEnd(&op_zstream2);
+}
+
+/* --stats and --trace: the rect picked for a frame, the trial sizes of
+ * op[0..3] (-1 when not tried). op_best>>1 is the dispose op of the frame
+ * before, op_best&1 the blend op of this one. The rect search started at
+ * t_rect.
+ */
+void frame_stats(FRAMESTATS & fs, int frame, int op_best, std::chrono::steady_clock::time_point t_rect)
+{
+  fs.frame = frame;
+  fs.x = op[op_best].x;
+  fs.y = op[op_best].y;
+  fs.w = op[op_best].w;
+  fs.h = op[op_best].h;
+  fs.op_best = op_best;
+  fs.filters = op[op_best].filters;
+  for (int j=0; j<4; j++)
+    fs.trials[j] = (op[j].valid) ? (int)op[j].size : -1;
+  fs.t0 = t_rect;
+  fs.t1 = std::chrono::steady_clock::now();
+  trace_complete("rects", fs.t0, fs.t1, frame);
+}
+
+// --stats and --trace: the final deflate of the frame, all its sub-frames with --split, started at t_fin.
+void frame_saved(const FRAMESTATS & fs, unsigned int size, unsigned int sub_frames, std::chrono::steady_clock::time_point t_fin)
+{
+  std::chrono::steady_clock::time_point t_done = std::chrono::steady_clock::now();
+
+  trace_complete("deflate", t_fin, t_done, fs.frame);
+  stats_record("save_frames", "\"frame\": %d, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, \"area\": %d, \"op_best\": %d, \"dispose_op\": %d, \"blend_op\": %d, "
+               "\"filters\": %d, \"trials\": [%d, %d, %d, %d], \"level\": %d, \"size\": %u, \"sub_frames\": %u, \"rect_ms\": %.3f, \"deflate_ms\": %.3f",
+               fs.frame, fs.x, fs.y, fs.w, fs.h, fs.w*fs.h, fs.op_best, fs.op_best >> 1, fs.op_best & 1,
+               fs.filters, fs.trials[0], fs.trials[1], fs.trials[2], fs.trials[3], fin_level, size, sub_frames, ms_between(fs.t0, fs.t1), ms_between(t_fin, t_done));
+}
+
+int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first, unsigned int loops, unsigned int coltype)
+{
+  FILE * f;
+  unsigned int i, j, k;
+  unsigned int x0, y0, w0, h0, dop, bop;
+  unsigned int idat_size, zbuf_size, zsize;
+  unsigned char * zbuf;
+  unsigned char header[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned int num_frames = frames.size();
+  unsigned int width = frames[0].w;
+  unsigned int height = frames[0].h;
+  unsigned int bpp = (coltype == 6) ? 4 : (coltype == 2) ? 3 : (coltype == 4) ? 2 : 1;
+  unsigned int has_tcolor = (coltype >= 4 || (coltype <= 2 && trnssize)) ? 1 : 0;
+  unsigned int tcolor = 0;
+  unsigned int rowbytes  = width * bpp;
+  unsigned int imagesize = rowbytes * height;
+
+  unsigned char * temp  = new unsigned char[imagesize];
+  unsigned char * over1 = new unsigned char[imagesize];
+  unsigned char * over2 = new unsigned char[imagesize];
+  unsigned char * over3 = new unsigned char[imagesize];
+  unsigned char * rest  = new unsigned char[imagesize];
+  unsigned char * rows  = new unsigned char[(rowbytes + 1) * height];
+  std::vector<unsigned char> key;
+  FRAMESTATS fs;
+  std::chrono::steady_clock::time_point t_rect, t_fin;
+
+  if (kmax)
+    plan_key_frames(frames, first, bpp, key);
 
   if (trnssize)
   {
@@ -1185,11 +2207,12 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
     }
   }
 
-  if ((f = fopen(szOut, "wb")) != 0)
+  if ((f = pipe_open_out(szOut)) != 0)
   {
     unsigned char buf_IHDR[13];
     unsigned char buf_acTL[8];
-    unsigned char buf_fcTL[26];
+    long          actl_pos = 0;
+    unsigned int  extra_frames = 0;
 
     png_save_uint_32(buf_IHDR, width);
     png_save_uint_32(buf_IHDR + 4, height);
@@ -1207,7 +2230,10 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
     write_chunk(f, "IHDR", buf_IHDR, 13);
 
     if (num_frames > 1)
+    {
+      actl_pos = ftell(f);
       write_chunk(f, "acTL", buf_acTL, 8);
+    }
     else
       first = 0;
 
@@ -1217,35 +2243,20 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
     if (trnssize > 0)
       write_chunk(f, "tRNS", trns, trnssize);
 
-    op_zstream1.data_type = Z_BINARY;
-    op_zstream1.zalloc = Z_NULL;
-    op_zstream1.zfree = Z_NULL;
-    op_zstream1.opaque = Z_NULL;
-    deflateInit2(&op_zstream1, Z_BEST_SPEED+1, 8, 15, 8, Z_DEFAULT_STRATEGY);
-
-    op_zstream2.data_type = Z_BINARY;
-    op_zstream2.zalloc = Z_NULL;
-    op_zstream2.zfree = Z_NULL;
-    op_zstream2.opaque = Z_NULL;
-    deflateInit2(&op_zstream2, Z_BEST_SPEED+1, 8, 15, 8, Z_FILTERED);
+    if (has_offs)
+    {
+      unsigned char buf_oFFs[9];
+      png_save_uint_32(buf_oFFs, offs_x);
+      png_save_uint_32(buf_oFFs + 4, offs_y);
+      buf_oFFs[8] = 0; // unit: pixels
+      write_chunk(f, "oFFs", buf_oFFs, 9);
+    }
 
     idat_size = (rowbytes + 1) * height;
     zbuf_size = idat_size + ((idat_size + 7) >> 3) + ((idat_size + 63) >> 6) + 11;
 
     zbuf = new unsigned char[zbuf_size];
-    op_zbuf1 = new unsigned char[zbuf_size];
-    op_zbuf2 = new unsigned char[zbuf_size];
-    row_buf = new unsigned char[rowbytes + 1];
-    sub_row = new unsigned char[rowbytes + 1];
-    up_row = new unsigned char[rowbytes + 1];
-    avg_row = new unsigned char[rowbytes + 1];
-    paeth_row = new unsigned char[rowbytes + 1];
-
-    row_buf[0] = 0;
-    sub_row[0] = 1;
-    up_row[0] = 2;
-    avg_row[0] = 3;
-    paeth_row[0] = 4;
+    op_init(rowbytes, zbuf_size);
 
     x0 = 0;
     y0 = 0;
@@ -1254,48 +2265,64 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
     bop = 0;
     next_seq_num = 0;
 
-    printf("saving %s (frame %d of %d)\n", szOut, 1-first, num_frames-first);
+    deadline.save_start = std::chrono::steady_clock::now();
+
+    if (!quiet)
+      printf("saving %s (frame %d of %d)\n", szOut, 1-first, num_frames-first);
+    t_rect = std::chrono::steady_clock::now();
     for (j=0; j<6; j++)
       op[j].valid = 0;
     deflate_rect_op(frames[0].p, x0, y0, w0, h0, bpp, rowbytes, zbuf_size, 0);
+    frame_stats(fs, 1-first, 0, t_rect);
+    set_fin_level(1-first, width*height, width*height, num_frames-1);
+    t_fin = std::chrono::steady_clock::now();
     deflate_rect_fin(zbuf, &zsize, bpp, rowbytes, rows, zbuf_size, 0);
+    frame_saved(fs, zsize, 1, t_fin);
 
     if (first)
     {
       write_IDATs(f, 0, zbuf, zsize, idat_size);
 
-      printf("saving %s (frame %d of %d)\n", szOut, 1, num_frames-first);
+      if (!quiet)
+        printf("saving %s (frame %d of %d)\n", szOut, 1, num_frames-first);
+      t_rect = std::chrono::steady_clock::now();
       for (j=0; j<6; j++)
         op[j].valid = 0;
       deflate_rect_op(frames[1].p, x0, y0, w0, h0, bpp, rowbytes, zbuf_size, 0);
+      frame_stats(fs, 1, 0, t_rect);
+      set_fin_level(1, width*height, width*height, num_frames-2);
+      t_fin = std::chrono::steady_clock::now();
       deflate_rect_fin(zbuf, &zsize, bpp, rowbytes, rows, zbuf_size, 0);
+      frame_saved(fs, zsize, 1, t_fin);
     }
 
     for (i=first; i<num_frames-1; i++)
     {
-      unsigned int op_min;
       int          op_best;
+      unsigned int split_size = 0, sub_frames = 1;
 
-      printf("saving %s (frame %d of %d)\n", szOut, i-first+2, num_frames-first);
+      spill_touch();
+      if (!quiet)
+        printf("saving %s (frame %d of %d)\n", szOut, i-first+2, num_frames-first);
+      t_rect = std::chrono::steady_clock::now();
       for (j=0; j<6; j++)
         op[j].valid = 0;
 
-      /* dispose = none */
-      get_rect(width, height, frames[i].p, frames[i+1].p, over1, bpp, rowbytes, zbuf_size, has_tcolor, tcolor, 0);
-
-      /* dispose = background */
-      if (has_tcolor)
+      if (!key.empty() && key[i+1])
       {
-        memcpy(temp, frames[i].p, imagesize);
-        if (coltype == 2)
-          for (j=0; j<h0; j++)
-            for (k=0; k<w0; k++)
-              memcpy(temp + ((j+y0)*width + (k+x0))*3, &tcolor, 3);
-        else
-          for (j=0; j<h0; j++)
-            memset(temp + ((j+y0)*width + x0)*bpp, tcolor, w0*bpp);
+        /* key frame: the whole canvas, blend op SOURCE */
+        if (!quiet)
+          printf("frame %d is a key frame\n", i-first+2);
+        deflate_rect_op(frames[i+1].p, 0, 0, width, height, bpp, rowbytes, zbuf_size, 0);
+      }
+      else
+      {
+        if (rect_threshold)
+          snap_near_pixels(width, height, frames[i].p, frames[i+1].p, bpp, coltype, has_tcolor, tcolor, rect_threshold);
 
-        get_rect(width, height, temp, frames[i+1].p, over2, bpp, rowbytes, zbuf_size, has_tcolor, tcolor, 1);
+        // Not tried any more once --deadline-ms had to fall back to the lowest level.
+        get_rects(width, height, frames[i].p, frames[i+1].p, temp, over1, over2, bpp, rowbytes, zbuf_size, coltype,
+                  has_tcolor && !(deadline.ms && fin_level == Z_BEST_SPEED), tcolor, x0, y0, w0, h0);
       }
 
       /* dispose = previous */
@@ -1303,30 +2330,15 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
       // if (i > first)
       //   get_rect(width, height, rest, frames[i+1].p, over3, bpp, rowbytes, zbuf_size, has_tcolor, tcolor, 2);
 
-      op_min = op[0].size;
-      op_best = 0;
-      for (j=1; j<6; j++)
-      if (op[j].valid)
-      {
-        if (op[j].size < op_min)
-        {
-          op_min = op[j].size;
-          op_best = j;
-        }
-      }
+      op_best = best_op();
+      frame_stats(fs, i-first+2, op_best, t_rect);
 
       dop = op_best >> 1;
 
-      png_save_uint_32(buf_fcTL, next_seq_num++);
-      png_save_uint_32(buf_fcTL + 4, w0);
-      png_save_uint_32(buf_fcTL + 8, h0);
-      png_save_uint_32(buf_fcTL + 12, x0);
-      png_save_uint_32(buf_fcTL + 16, y0);
-      png_save_uint_16(buf_fcTL + 20, frames[i].delay_num);
-      png_save_uint_16(buf_fcTL + 22, frames[i].delay_den);
-      buf_fcTL[24] = dop;
-      buf_fcTL[25] = bop;
-      write_chunk(f, "fcTL", buf_fcTL, 26);
+      deadline.frames++;
+      set_fin_level(i-first+2, op[op_best].w*op[op_best].h, width*height, num_frames-i-2);
+
+      write_fcTL(f, w0, h0, x0, y0, frames[i].delay_num, frames[i].delay_den, dop, bop);
 
       write_IDATs(f, i, zbuf, zsize, idat_size);
 
@@ -1346,45 +2358,82 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
       }
       /* process apng dispose - end */
 
+      bop = op_best & 1;
+
+      /* split the changes into several sub-frames - begin */
+      // All but the last sub-frame get a 0/0 delay, they are shown together with the last one.
+      if (split_frames && op[op_best].w * op[op_best].h > 1 && (key.empty() || !key[i+1]))
+      {
+        std::vector<RECT> rects;
+        find_clusters(width, height, (dop == 1) ? temp : frames[i].p, frames[i+1].p, bpp, rects);
+
+        if (rects.size() > 1)
+        {
+          std::vector<OP> ops;
+          unsigned int total = 0;
+          for (j=0; j<rects.size(); j++)
+          {
+            deflate_rect_op(op[op_best].p, rects[j].x, rects[j].y, rects[j].w, rects[j].h, bpp, rowbytes, zbuf_size, 4);
+            ops.push_back(op[4]);
+            total += op[4].size + cSplitFrameCost;
+          }
+
+          if (total < op[op_best].size + cSplitFrameCost)
+          {
+            if (!quiet)
+              printf("splitting frame %d into %d sub-frames\n", i-first+2, (int)ops.size());
+            t_fin = std::chrono::steady_clock::now();
+            for (j=0; j+1<ops.size(); j++)
+            {
+              op[4] = ops[j];
+              deflate_rect_fin(zbuf, &zsize, bpp, rowbytes, rows, zbuf_size, 4);
+              write_fcTL(f, ops[j].w, ops[j].h, ops[j].x, ops[j].y, 0, 0, 0, bop);
+              write_IDATs(f, i+1, zbuf, zsize, idat_size);
+              split_size += zsize;
+            }
+            sub_frames = ops.size();
+            extra_frames += ops.size() - 1;
+            op[op_best] = ops.back();
+          }
+        }
+      }
+      /* split the changes into several sub-frames - end */
+
       x0 = op[op_best].x;
       y0 = op[op_best].y;
       w0 = op[op_best].w;
       h0 = op[op_best].h;
-      bop = op_best & 1;
 
+      if (sub_frames == 1)
+        t_fin = std::chrono::steady_clock::now();
       deflate_rect_fin(zbuf, &zsize, bpp, rowbytes, rows, zbuf_size, op_best);
+      frame_saved(fs, split_size + zsize, sub_frames, t_fin);
     }
 
     if (num_frames > 1)
     {
-      png_save_uint_32(buf_fcTL, next_seq_num++);
-      png_save_uint_32(buf_fcTL + 4, w0);
-      png_save_uint_32(buf_fcTL + 8, h0);
-      png_save_uint_32(buf_fcTL + 12, x0);
-      png_save_uint_32(buf_fcTL + 16, y0);
-      png_save_uint_16(buf_fcTL + 20, frames[num_frames-1].delay_num);
-      png_save_uint_16(buf_fcTL + 22, frames[num_frames-1].delay_den);
-      buf_fcTL[24] = 0;
-      buf_fcTL[25] = bop;
-      write_chunk(f, "fcTL", buf_fcTL, 26);
+      write_fcTL(f, w0, h0, x0, y0, frames[num_frames-1].delay_num, frames[num_frames-1].delay_den, 0, bop);
     }
 
     write_IDATs(f, num_frames-1, zbuf, zsize, idat_size);
 
     write_chunk(f, "IEND", 0, 0);
-    fclose(f);
 
-    delete[] zbuf;
-    delete[] op_zbuf1;
-    delete[] op_zbuf2;
-    delete[] row_buf;
-    delete[] sub_row;
-    delete[] up_row;
-    delete[] avg_row;
-    delete[] paeth_row;
+    if (deadline.reduced)
+      printf("%d of %d frames compressed at reduced effort\n", deadline.reduced, num_frames-first);
 
-    deflateEnd(&op_zstream1);
-    deflateEnd(&op_zstream2);
+    if (extra_frames)
+    {
+      long end = ftell(f);
+      png_save_uint_32(buf_acTL, num_frames-first+extra_frames);
+      fseek(f, actl_pos, SEEK_SET);
+      write_chunk(f, "acTL", buf_acTL, 8);
+      fseek(f, end, SEEK_SET);
+    }
+    pipe_close_out(f);
+
+    delete[] zbuf;
+    op_free();
   }
   else
   {
@@ -1403,6 +2452,298 @@ int save_apng(char * szOut, std::vector<APNGFrame>& frames, unsigned int first,
 }
 /* APNG encoder - end */
 
+/* APNG stream encoder - begin */
+/* A bounded queue between two --stream stages. queue_push() waits while the
+ * queue is full, queue_pop() waits while it is empty and returns false once
+ * the queue is closed and drained.
+ */
+template <class T> struct QUEUE
+{
+  std::deque<T> items;
+  std::mutex m;
+  std::condition_variable cv;
+  bool closed;
+};
+
+template <class T> void queue_push(QUEUE<T> & q, const T & item)
+{
+  std::unique_lock<std::mutex> lock(q.m);
+  q.cv.wait(lock, [&q]{ return q.items.size() < cStreamQueue; });
+  q.items.push_back(item);
+  q.cv.notify_all();
+}
+
+template <class T> bool queue_pop(QUEUE<T> & q, T & item)
+{
+  std::unique_lock<std::mutex> lock(q.m);
+  q.cv.wait(lock, [&q]{ return !q.items.empty() || q.closed; });
+  if (q.items.empty())
+    return false;
+  item = q.items.front();
+  q.items.pop_front();
+  q.cv.notify_all();
+  return true;
+}
+
+template <class T> void queue_close(QUEUE<T> & q)
+{
+  std::unique_lock<std::mutex> lock(q.m);
+  q.closed = true;
+  q.cv.notify_all();
+}
+
+QUEUE<APNGFrame> decoded;
+QUEUE<STREAMJOB> chosen;
+
+void stream_frame_fn(APNGFrame & frame)
+{
+  queue_push(decoded, frame);
+}
+
+/* Stage 2: picks the rect of every frame. Only the previous canvas is kept.
+ * A frame's job is passed on when the next frame has decided its dispose op.
+ */
+void stream_rects(unsigned int & first)
+{
+  APNGFrame prev = {0};
+  APNGFrame cur;
+  STREAMJOB job = {0};
+  unsigned int width = 0, height = 0, rowbytes = 0, imagesize = 0, zbuf_size = 0;
+  unsigned int x0 = 0, y0 = 0, w0 = 0, h0 = 0;
+  unsigned int i, j, n = 0;
+  unsigned char * temp = NULL;
+  unsigned char * over1 = NULL;
+  unsigned char * over2 = NULL;
+
+  trace_thread_name("stream_rects");
+  while (queue_pop(decoded, cur))
+  {
+    int op_best = 0;
+    FRAMESTATS fs;
+
+    if (n == 0)
+    {
+      width = cur.w;
+      height = cur.h;
+      rowbytes = width * 4;
+      imagesize = rowbytes * height;
+      zbuf_size = (rowbytes + 1) * height;
+      zbuf_size += ((zbuf_size + 7) >> 3) + ((zbuf_size + 63) >> 6) + 11;
+      temp = new unsigned char[imagesize];
+      over1 = new unsigned char[imagesize];
+      over2 = new unsigned char[imagesize];
+      op_init(rowbytes, zbuf_size);
+    }
+
+    unsigned char * sp = cur.p;
+    for (i=0; i<width*height; i++, sp+=4)
+      if (sp[3] == 0)
+        sp[0] = sp[1] = sp[2] = 0;
+
+    if (n > first && memcmp(prev.p, cur.p, imagesize) == 0)
+    {
+      APNGFrame merged = {0};
+      merged.delay_num = job.delay_num;
+      merged.delay_den = job.delay_den;
+      merge_delay(merged, cur.delay_num, cur.delay_den);
+      job.delay_num = merged.delay_num;
+      job.delay_den = merged.delay_den;
+      delete[] cur.rows;
+      canvas_free(cur.p);
+      continue;
+    }
+
+    std::chrono::steady_clock::time_point t_rect = std::chrono::steady_clock::now();
+    for (j=0; j<6; j++)
+      op[j].valid = 0;
+
+    if (n <= first)
+    {
+      // the first frame and the default image are written in full
+      deflate_rect_op(cur.p, 0, 0, width, height, 4, rowbytes, zbuf_size, 0);
+    }
+    else
+    {
+      if (rect_threshold)
+        snap_near_pixels(width, height, prev.p, cur.p, 4, 6, 1, 0, rect_threshold);
+      get_rects(width, height, prev.p, cur.p, temp, over1, over2, 4, rowbytes, zbuf_size, 6, 1, 0, x0, y0, w0, h0);
+      op_best = best_op();
+    }
+    frame_stats(fs, n-first+1, op_best, t_rect);
+
+    if (n > 0)
+    {
+      job.dop = op_best >> 1;
+      queue_push(chosen, job);
+    }
+
+    // the job keeps its own copy of the rect, the buffers above are reused
+    job.x = op[op_best].x;
+    job.y = op[op_best].y;
+    job.w = op[op_best].w;
+    job.h = op[op_best].h;
+    job.filters = op[op_best].filters;
+    job.bop = op_best & 1;
+    job.delay_num = cur.delay_num;
+    job.delay_den = cur.delay_den;
+    job.fs = fs;
+    job.p = new unsigned char[job.w * job.h * 4];
+    for (j=0; j<job.h; j++)
+      memcpy(job.p + j*job.w*4, op[op_best].p + ((job.y+j)*width + job.x)*4, job.w*4);
+
+    x0 = job.x;
+    y0 = job.y;
+    w0 = job.w;
+    h0 = job.h;
+
+    if (prev.p)
+    {
+      delete[] prev.rows;
+      canvas_free(prev.p);
+    }
+    prev = cur;
+    n++;
+  }
+
+  if (n > 0)
+  {
+    job.dop = 0;
+    queue_push(chosen, job);
+
+    delete[] prev.rows;
+    canvas_free(prev.p);
+    delete[] temp;
+    delete[] over1;
+    delete[] over2;
+    op_free();
+  }
+  queue_close(chosen);
+}
+
+/* Stage 3: compresses the chosen rects and writes them. The frame count in
+ * acTL is only known at the end and is patched in. The filter rows are per
+ * thread, so this one has its own.
+ */
+int stream_write(FILE * f, unsigned int & first, unsigned int & loops)
+{
+  unsigned char header[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned char buf_IHDR[13];
+  unsigned char buf_acTL[8];
+  unsigned char * zbuf = NULL;
+  unsigned char * rows = NULL;
+  unsigned int zbuf_size = 0, idat_size = 0, zsize;
+  unsigned int n = 0;
+  long actl_pos = 0;
+  STREAMJOB job;
+
+  while (queue_pop(chosen, job))
+  {
+    if (n == 0)
+    {
+      // the first job is the whole canvas
+      png_save_uint_32(buf_IHDR, job.w);
+      png_save_uint_32(buf_IHDR + 4, job.h);
+      buf_IHDR[8] = 8;
+      buf_IHDR[9] = 6;
+      buf_IHDR[10] = 0;
+      buf_IHDR[11] = 0;
+      buf_IHDR[12] = 0;
+      fwrite(header, 1, 8, f);
+      write_chunk(f, "IHDR", buf_IHDR, 13);
+
+      actl_pos = ftell(f);
+      png_save_uint_32(buf_acTL, 0);
+      png_save_uint_32(buf_acTL + 4, loops);
+      write_chunk(f, "acTL", buf_acTL, 8);
+
+      idat_size = (job.w * 4 + 1) * job.h;
+      zbuf_size = idat_size + ((idat_size + 7) >> 3) + ((idat_size + 63) >> 6) + 11;
+      zbuf = new unsigned char[zbuf_size];
+      rows = new unsigned char[idat_size];
+      filter_init(job.w * 4);
+      next_seq_num = 0;
+    }
+
+    op[0].p = job.p;
+    op[0].x = 0;
+    op[0].y = 0;
+    op[0].w = job.w;
+    op[0].h = job.h;
+    op[0].filters = job.filters;
+    std::chrono::steady_clock::time_point t_fin = std::chrono::steady_clock::now();
+    deflate_rect_fin(zbuf, &zsize, 4, job.w * 4, rows, zbuf_size, 0);
+    frame_saved(job.fs, zsize, 1, t_fin);
+
+    if (n >= first)
+    {
+      if (!quiet)
+        printf("saving frame %d\n", n-first+1);
+      write_fcTL(f, job.w, job.h, job.x, job.y, job.delay_num, job.delay_den, job.dop, job.bop);
+    }
+    write_IDATs(f, n, zbuf, zsize, idat_size);
+    delete[] job.p;
+    n++;
+  }
+
+  if (n == 0)
+    return 1;
+
+  write_chunk(f, "IEND", 0, 0);
+  long end = ftell(f);
+  png_save_uint_32(buf_acTL, n-first);
+  fseek(f, actl_pos, SEEK_SET);
+  write_chunk(f, "acTL", buf_acTL, 8);
+  fseek(f, end, SEEK_SET);
+
+  delete[] zbuf;
+  delete[] rows;
+  filter_free();
+  return 0;
+}
+
+/* --stream: decoding, the rect search and the final compression run on
+ * three threads connected by bounded queues, so they overlap and only a few
+ * frames are in memory at a time. The passes that need the whole animation
+ * first (color type reduction, cropping, key frame planning, ...) are not
+ * available, and the output is always RGBA.
+ */
+int stream_apng(char * szIn, char * szOut)
+{
+  FILE * f;
+  std::vector<APNGFrame> unused;
+  unsigned int first = 0, loops = 0;
+  int res_load, res_write;
+
+  if ((f = pipe_open_out(szOut)) == 0)
+  {
+    printf( "Error: couldn't open file for writing\n" );
+    return 1;
+  }
+
+  frame_fn = stream_frame_fn;
+  std::thread rects(stream_rects, std::ref(first));
+  std::thread load([&]{ trace_thread_name("load_apng"); res_load = load_apng(szIn, unused, first, loops); queue_close(decoded); });
+
+  res_write = stream_write(f, first, loops);
+  load.join();
+  rects.join();
+  pipe_close_out(f);
+  frame_fn = NULL;
+
+  if (res_load < 0 || res_write != 0)
+  {
+    printf("load_apng() failed: '%s'\n", szIn);
+    // stream_write() has written the frames before the failure
+    if (!pipe_is_std(szOut))
+      remove(szOut);
+    return 1;
+  }
+  return 0;
+}
+/* APNG stream encoder - end */
+
+// benchmarks/bench_kernels.cpp includes this file to call the kernels directly
+#ifndef APNGOPT_NO_MAIN
 int main(int argc, char** argv)
 {
   char   szInput[256];
@@ -1411,12 +2752,41 @@ int main(int argc, char** argv)
   char * szExt;
   std::vector<APNGFrame> frames;
   unsigned int first, loops, coltype;
-
-  printf("\nAPNG Optimizer 1.4\n\n");
+  unsigned int crop = 0;
+  unsigned int keep_offset = 0;
+  unsigned int max_fps = 0;
+  unsigned int stream = 0;
+  unsigned int memory_budget = 0;
+  char * szStats = NULL;
+  char * szTrace = NULL;
+  int merge_threshold = -1;
+  double merge_fraction = 0;
+
+  deadline.start = std::chrono::steady_clock::now();
 
   if (argc <= 1)
   {
-    printf("Usage: apngopt anim.png [anim_opt.png]\n\n");
+    printf("\nAPNG Optimizer 1.4\n\n");
+    printf("Usage: apngopt [options] anim.png [anim_opt.png]\n\n");
+    printf("anim.png can be - for stdin, anim_opt.png - for stdout (the default with stdin).\n");
+    printf("Messages then go to stderr.\n\n");
+    printf("Options:\n");
+    printf("  --scale n     : decode and optimize at 1/n of the original size\n");
+    printf("  --crop        : crop the canvas to the visible content of all frames\n");
+    printf("  --keep-offset : with --crop, store the crop offset in an oFFs chunk\n");
+    printf("  --merge-threshold t : merge frames whose pixels differ by at most t (lossy)\n");
+    printf("  --merge-fraction f  : with --merge-threshold, allow a fraction f of the pixels to differ more\n");
+    printf("  --rect-threshold t  : treat pixels that change by at most t as unchanged (lossy)\n");
+    printf("  --max-fps n   : drop frames to play at most n frames per second\n");
+    printf("  --split       : split far apart changes of a frame into several sub-frames\n");
+    printf("  --deadline-ms n : lower the compression level of frames to finish within n ms\n");
+    printf("  --kmax n      : write a full canvas key frame at least every n frames\n");
+    printf("  --kmin n      : with --kmax, at least n frames between key frames (default n/2)\n");
+    printf("  --stream      : decode, optimize and compress at the same time, keeping only a few frames in memory\n");
+    printf("  --memory-budget n : stay within n MB, keeping the frames in a spill file if needed\n");
+    printf("  --stats file  : write the time and memory use of every stage, and of every frame, to a JSON file\n");
+    printf("  --trace file  : write the stages and the work on every frame as Chrome trace events to a JSON file\n");
+    printf("  --quiet       : no output for every frame\n\n");
     return 1;
   }
 
@@ -1427,6 +2797,136 @@ int main(int argc, char** argv)
   {
     szOpt = argv[i];
 
+    if (strcmp(szOpt, "--scale") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 16)
+      {
+        printf("Error: scale must be between 1 and 16\n");
+        return 1;
+      }
+      scale = n;
+    }
+    else
+    if (strcmp(szOpt, "--crop") == 0)
+      crop = 1;
+    else
+    if (strcmp(szOpt, "--keep-offset") == 0)
+      keep_offset = 1;
+    else
+    if (strcmp(szOpt, "--split") == 0)
+      split_frames = 1;
+    else
+    if (strcmp(szOpt, "--stream") == 0)
+      stream = 1;
+    else
+    if (strcmp(szOpt, "--quiet") == 0)
+      quiet = 1;
+    else
+    if (strcmp(szOpt, "--trace") == 0 && i+1 < argc)
+    {
+      szTrace = argv[++i];
+      trace_start("apngopt");
+    }
+    else
+    if (strcmp(szOpt, "--stats") == 0 && i+1 < argc)
+    {
+      szStats = argv[++i];
+      stats.enabled = true;
+    }
+    else
+    if (strcmp(szOpt, "--merge-threshold") == 0 && i+1 < argc)
+    {
+      merge_threshold = atoi(argv[++i]);
+      if (merge_threshold < 0 || merge_threshold > 255)
+      {
+        printf("Error: merge threshold must be between 0 and 255\n");
+        return 1;
+      }
+    }
+    else
+    if (strcmp(szOpt, "--rect-threshold") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 0 || n > 255)
+      {
+        printf("Error: rect threshold must be between 0 and 255\n");
+        return 1;
+      }
+      rect_threshold = n;
+    }
+    else
+    if (strcmp(szOpt, "--deadline-ms") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 1)
+      {
+        printf("Error: deadline must be at least 1 ms\n");
+        return 1;
+      }
+      deadline.ms = n;
+    }
+    else
+    if (strcmp(szOpt, "--kmax") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 1)
+      {
+        printf("Error: kmax must be at least 1\n");
+        return 1;
+      }
+      kmax = n;
+    }
+    else
+    if (strcmp(szOpt, "--kmin") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 1)
+      {
+        printf("Error: kmin must be at least 1\n");
+        return 1;
+      }
+      kmin = n;
+    }
+    else
+    if (strcmp(szOpt, "--memory-budget") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 1)
+      {
+        printf("Error: memory budget must be at least 1 MB\n");
+        return 1;
+      }
+      memory_budget = n;
+    }
+    else
+    if (strcmp(szOpt, "--max-fps") == 0 && i+1 < argc)
+    {
+      int n = atoi(argv[++i]);
+      if (n < 1 || n > 1000)
+      {
+        printf("Error: max fps must be between 1 and 1000\n");
+        return 1;
+      }
+      max_fps = n;
+    }
+    else
+    if (strcmp(szOpt, "--merge-fraction") == 0 && i+1 < argc)
+    {
+      merge_fraction = atof(argv[++i]);
+      if (merge_fraction < 0 || merge_fraction > 1)
+      {
+        printf("Error: merge fraction must be between 0 and 1\n");
+        return 1;
+      }
+    }
+    else
+    if (strlen(szOpt) + 8 >= sizeof(szOut))
+    {
+      printf("Error: path too long: '%s'\n", szOpt);
+      return 1;
+    }
+    else
     if (szInput[0] == 0)
       strcpy(szInput, szOpt);
     else
@@ -1434,6 +2934,26 @@ int main(int argc, char** argv)
       strcpy(szOut, szOpt);
   }
 
+  if (szOut[0] == 0 && pipe_is_std(szInput))
+    strcpy(szOut, "-");
+  // before the first message, they would end up in the output
+  if (pipe_is_std(szOut))
+    pipe_stdout();
+  printf("\nAPNG Optimizer 1.4\n\n");
+
+  if (kmin && !kmax)
+  {
+    printf("Error: --kmin needs --kmax\n");
+    return 1;
+  }
+  if (kmax && !kmin)
+    kmin = (kmax > 1) ? kmax / 2 : 1;
+  if (kmin > kmax)
+  {
+    printf("Error: kmin must not be larger than kmax\n");
+    return 1;
+  }
+
   if (szOut[0] == 0)
   {
     strcpy(szOut, szInput);
@@ -1441,27 +2961,88 @@ int main(int argc, char** argv)
     strcat(szOut, "_opt.png");
   }
 
+  if (stream && (crop || merge_threshold >= 0 || max_fps || kmax || split_frames || deadline.ms))
+  {
+    printf("Error: --stream can't be combined with --crop, --merge-threshold, --max-fps, --kmax, --split or --deadline-ms\n");
+    return 1;
+  }
+
+  if (memory_budget && memory_plan(szInput, szOut, memory_budget, stream) != 0)
+    return 1;
+
+  if (stream)
+  {
+    // the stages run at the same time, so they are timed as one
+    stats_begin("stream_apng");
+    int res = stream_apng(szInput, szOut);
+    stats_end();
+    if (res != 0)
+      return 1;
+    if (szStats && stats_write(szStats, "apngopt", szInput) != 0)
+      return 1;
+    if (szTrace && trace_write(szTrace) != 0)
+      return 1;
+    printf("all done\n");
+    return 0;
+  }
+
+  stats_begin("load_apng");
   int res = load_apng(szInput, frames, first, loops);
+  stats_end();
   if (res < 0)
   {
     printf("load_apng() failed: '%s'\n", szInput);
     return 1;
   }
 
+  stats_begin("optim_dirty");
   optim_dirty(frames);
+  stats_end();
+  if (crop)
+  {
+    stats_begin("optim_crop");
+    optim_crop(frames, offs_x, offs_y);
+    stats_end();
+    has_offs = keep_offset;
+  }
+  stats_begin("optim_duplicates");
   optim_duplicates(frames, first);
+  stats_end();
+  if (merge_threshold >= 0)
+  {
+    stats_begin("optim_near_duplicates");
+    optim_near_duplicates(frames, first, merge_threshold, (unsigned int)(merge_fraction * frames[0].w * frames[0].h));
+    stats_end();
+  }
+  if (max_fps)
+  {
+    stats_begin("optim_max_fps");
+    optim_max_fps(frames, first, max_fps);
+    stats_end();
+  }
+  stats_begin("optim_downconvert");
   optim_downconvert(frames, coltype);
+  stats_end();
 
+  stats_begin("save_apng");
   save_apng(szOut, frames, first, loops, coltype);
+  stats_end();
 
   for (size_t j=0; j<frames.size(); j++)
   {
     delete[] frames[j].rows;
-    delete[] frames[j].p;
+    canvas_free(frames[j].p);
   }
   frames.clear();
+  spill_close();
+
+  if (szStats && stats_write(szStats, "apngopt", szInput) != 0)
+    return 1;
+  if (szTrace && trace_write(szTrace) != 0)
+    return 1;
 
   printf("all done\n");
 
   return 0;
 }
+#endif /* APNGOPT_NO_MAIN */
@@ -32,10 +32,13 @@
 #include <fstream>
 #include <stdlib.h>
 #include <vector>
+#include <algorithm>
 #include <cstring>
 #include "png.h"     /* original (unpatched) libpng is ok */
 #include "zlib.h"
 #include "json/writer.h"
+#include "stats.h"
+#include "pipe.h"
 using namespace std;
 
 #if defined(_MSC_VER) && _MSC_VER >= 1300
@@ -66,6 +69,9 @@ unsigned int swap32(unsigned int data) {return((data & 0xFF) << 24) | ((data & 0
 #define id_IDAT 0x54414449
 #define id_fdAT 0x54416466
 #define id_IEND 0x444E4549
+#define id_oFFs 0x7346466F
+#define id_PLTE 0x45544C50
+#define id_tRNS 0x534E5274
 
 struct CHUNK { unsigned char * p; unsigned int size; };
 
@@ -86,17 +92,91 @@ struct APNGFrame
   png_bytep * rows;
 };
 
+struct FRAMEINFO
+{
+  unsigned int x, y;
+  unsigned int w, h;
+  unsigned int delay_num, delay_den;
+  unsigned int blend_op, dispose_op;
+  unsigned int data_size;
+  unsigned int key;
+  long offset;
+};
+
 vector<CHUNK> info_chunks;
 vector<APNGFrame> frames;
+vector<FRAMEINFO> frames_info;
 
 unsigned int num_frames = 1;
+unsigned int num_plays = 0;
+unsigned int canvas_w = 0;
+unsigned int canvas_h = 0;
+unsigned int has_offs = 0;
+unsigned int offs_x, offs_y;
+
+/* --keep-colortype: palette, gray and gray+alpha animations of up to 8 bits
+ * are extracted as 8 bit indices or levels instead of RGBA. The palette
+ * (PLTE with the alpha of tRNS) or the transparent gray level is the same
+ * for all frames and kept here.
+ */
+unsigned int keep_coltype = 0;
+unsigned int out_coltype = 6;
+unsigned int out_bpp = 4;
+unsigned char palette[256][4];
+unsigned int palsize = 0;
+int trns_gray = -1;
+
+// From the bit depth and color type of IHDR. ProbeAPNG() and LoadAPNG() use the same rules.
+void keep_coltype_ihdr(unsigned char depth, unsigned char coltype)
+{
+  out_coltype = 6;
+  if (keep_coltype && depth <= 8 && (coltype == 0 || coltype == 3 || coltype == 4))
+    out_coltype = coltype;
+  out_bpp = (out_coltype == 6) ? 4 : (out_coltype == 4) ? 2 : 1;
+}
+
+// PLTE and tRNS, data is the chunk data.
+void keep_coltype_chunk(unsigned int id, unsigned char * data, unsigned int len, unsigned char depth)
+{
+  unsigned int i;
+
+  if (id == id_PLTE && out_coltype == 3)
+  {
+    palsize = len / 3;
+    if (palsize > 256)
+      palsize = 256;
+    for (i=0; i<palsize; i++)
+    {
+      memcpy(palette[i], data + i*3, 3);
+      palette[i][3] = 255;
+    }
+  }
+  if (id == id_tRNS && out_coltype == 3)
+  {
+    for (i=0; i<len && i<palsize; i++)
+      palette[i][3] = data[i];
+  }
+  if (id == id_tRNS && out_coltype == 0 && len == 2)
+  {
+    // scaled to 8 bits like the levels
+    trns_gray = (data[0]*256 + data[1]) * 255 / ((1 << depth) - 1);
+  }
+}
 
 void info_fn(png_structp png_ptr, png_infop info_ptr)
 {
-  png_set_expand(png_ptr);
-  png_set_strip_16(png_ptr);
-  png_set_gray_to_rgb(png_ptr);
-  png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+  if (out_coltype == 6)
+  {
+    png_set_expand(png_ptr);
+    png_set_strip_16(png_ptr);
+    png_set_gray_to_rgb(png_ptr);
+    png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+  }
+  else
+  if (out_coltype == 3)
+    png_set_packing(png_ptr);
+  else
+    png_set_expand_gray_1_2_4_to_8(png_ptr);
   (void)png_set_interlace_handling(png_ptr);
   png_read_update_info(png_ptr, info_ptr);
 }
@@ -107,6 +187,7 @@ void row_fn(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pas
   png_progressive_combine_row(png_ptr, frame->rows[row_num], new_row);
 }
 
+// Indices and gray levels are copied as they are, fully transparent ones included.
 void compose_frame(unsigned char ** rows_dst, unsigned char ** rows_src, unsigned char bop, unsigned int w, unsigned int h)
 {
   unsigned int  i, j;
@@ -117,10 +198,10 @@ void compose_frame(unsigned char ** rows_dst, unsigned char ** rows_src, unsigne
     unsigned char * sp = rows_src[j];
     unsigned char * dp = rows_dst[j];
 
-    memset(dp, 0, w*4);
+    memset(dp, 0, w*out_bpp);
 
-    if (bop == APNG_BLEND_OP_SOURCE)
-      memcpy(dp, sp, w*4);
+    if (bop == APNG_BLEND_OP_SOURCE || out_bpp != 4)
+      memcpy(dp, sp, w*out_bpp);
     else
     for (i=0; i<w; i++, sp+=4, dp+=4)
     {
@@ -169,7 +250,213 @@ void recalc_crc(unsigned char * p, unsigned int size)
   memcpy(p + size - 4, &crc, 4);
 }
 
-int LoadAPNG(char * szIn)
+/* Walks the chunk stream only. IDAT/fdAT payloads are skipped with fseek(),
+ * so nothing proportional to the pixel count is ever allocated or inflated.
+ */
+int ProbeAPNG(char * szIn)
+{
+  FILE         * f;
+  unsigned int   len, id;
+  unsigned char  buf[26];
+  unsigned char  sig[8];
+  unsigned char  header[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned int   flag_actl = 0;
+  unsigned int   flag_fctl = 0;
+  unsigned int   flag_idat = 0;
+  unsigned char  depth = 8;
+  unsigned char  pal[768];
+  FRAMEINFO      info = {0};
+  long           offset;
+  int            res = 1;
+
+  if ((f = pipe_open_in(szIn, true)) == 0)
+    return 1;
+
+  if (fread(sig, 1, 8, f) == 8 && memcmp(sig, header, 8) == 0)
+  {
+    while (1)
+    {
+      offset = ftell(f);
+      if (fread(buf, 1, 8, f) != 8)
+        break;
+      len = png_get_uint_32(buf);
+      memcpy(&id, buf + 4, 4);
+
+      if (id == id_IHDR || id == id_acTL || id == id_fcTL || id == id_oFFs)
+      {
+        unsigned int need = (id == id_IHDR) ? 13 : (id == id_acTL) ? 8 : (id == id_oFFs) ? 9 : 26;
+        if (len != need || fread(buf, 1, need, f) != need || fseek(f, 4, SEEK_CUR) != 0)
+          break;
+      }
+      else
+      if ((id == id_PLTE || id == id_tRNS) && keep_coltype && !flag_idat && len <= sizeof(pal))
+      {
+        if (fread(pal, 1, len, f) != len || fseek(f, 4, SEEK_CUR) != 0)
+          break;
+        keep_coltype_chunk(id, pal, len, depth);
+      }
+      else
+      if (fseek(f, (long)len + 4, SEEK_CUR) != 0)
+        break;
+
+      if (id == id_IHDR)
+      {
+        canvas_w = png_get_uint_32(buf);
+        canvas_h = png_get_uint_32(buf + 4);
+        depth = buf[8];
+        keep_coltype_ihdr(buf[8], buf[9]);
+      }
+      else
+      if (id == id_acTL)
+      {
+        flag_actl = 1;
+        num_frames = png_get_uint_32(buf);
+        num_plays = png_get_uint_32(buf + 4);
+      }
+      else
+      if (id == id_oFFs)
+      {
+        has_offs = (buf[8] == 0);
+        offs_x = png_get_uint_32(buf);
+        offs_y = png_get_uint_32(buf + 4);
+      }
+      else
+      if (id == id_fcTL)
+      {
+        info.w = png_get_uint_32(buf + 4);
+        info.h = png_get_uint_32(buf + 8);
+        info.x = png_get_uint_32(buf + 12);
+        info.y = png_get_uint_32(buf + 16);
+        info.delay_num = png_get_uint_16(buf + 20);
+        info.delay_den = png_get_uint_16(buf + 22);
+        info.dispose_op = buf[24];
+        info.blend_op = buf[25];
+        info.data_size = 0;
+        info.offset = offset;
+        if (!flag_fctl)
+        {
+          info.blend_op = APNG_BLEND_OP_SOURCE;
+          if (info.dispose_op == APNG_DISPOSE_OP_PREVIOUS)
+            info.dispose_op = APNG_DISPOSE_OP_BACKGROUND;
+        }
+        flag_fctl = 1;
+        frames_info.push_back(info);
+      }
+      else
+      if (id == id_IDAT)
+      {
+        flag_idat = 1;
+        if (!flag_actl && frames_info.empty())
+        {
+          info.x = info.y = 0;
+          info.w = canvas_w;
+          info.h = canvas_h;
+          info.delay_num = 1;
+          info.delay_den = 10;
+          info.dispose_op = APNG_DISPOSE_OP_NONE;
+          info.blend_op = APNG_BLEND_OP_SOURCE;
+          info.data_size = 0;
+          info.offset = offset;
+          frames_info.push_back(info);
+        }
+        if (!frames_info.empty() && (flag_fctl || !flag_actl))
+          frames_info.back().data_size += len;
+      }
+      else
+      if (id == id_fdAT)
+      {
+        if (!frames_info.empty() && len >= 4)
+          frames_info.back().data_size += len - 4;
+      }
+      else
+      if (id == id_IEND)
+      {
+        res = 0;
+        break;
+      }
+      else
+      if (notabc(buf[4]) || notabc(buf[5]) || notabc(buf[6]) || notabc(buf[7]))
+        break;
+    }
+  }
+  fclose(f);
+
+  /* A key frame's composite does not depend on earlier frames: it replaces
+   * the whole canvas, or the canvas was fully cleared by the frame before.
+   */
+  for (unsigned int i=0; i<frames_info.size(); i++)
+  {
+    FRAMEINFO & cur = frames_info[i];
+    cur.key = (i == 0) ||
+      (cur.blend_op == APNG_BLEND_OP_SOURCE && cur.x == 0 && cur.y == 0 && cur.w == canvas_w && cur.h == canvas_h);
+    if (i > 0)
+    {
+      FRAMEINFO & prev = frames_info[i-1];
+      if (prev.dispose_op == APNG_DISPOSE_OP_BACKGROUND && prev.x == 0 && prev.y == 0 && prev.w == canvas_w && prev.h == canvas_h)
+        cur.key = 1;
+    }
+  }
+
+  if (!frames_info.empty())
+    res = 0;
+
+  return res;
+}
+
+Json::Value frame_metadata(const char * src, const FRAMEINFO & info)
+{
+  Json::Value frame_metadata;
+  frame_metadata["src"] = Json::Value(src);
+  frame_metadata["delay_num"] = Json::Value(info.delay_num);
+  frame_metadata["delay_den"] = Json::Value(info.delay_den);
+  frame_metadata["x"] = Json::Value(info.x);
+  frame_metadata["y"] = Json::Value(info.y);
+  frame_metadata["w"] = Json::Value(info.w);
+  frame_metadata["h"] = Json::Value(info.h);
+  frame_metadata["blend_op"] = Json::Value(info.blend_op);
+  frame_metadata["dispose_op"] = Json::Value(info.dispose_op);
+  return frame_metadata;
+}
+
+void animation_metadata(Json::Value & apng_obj)
+{
+  apng_obj["width"] = Json::Value(canvas_w);
+  apng_obj["height"] = Json::Value(canvas_h);
+  apng_obj["loops"] = Json::Value(num_plays);
+  if (has_offs)
+  {
+    // offset of this canvas in the original one, see apngopt --keep-offset
+    apng_obj["x_offset"] = Json::Value(offs_x);
+    apng_obj["y_offset"] = Json::Value(offs_y);
+  }
+  if (keep_coltype)
+  {
+    apng_obj["color_type"] = Json::Value(out_coltype);
+    if (out_coltype == 3)
+    {
+      Json::Value pal(Json::arrayValue);
+      for (unsigned int i=0; i<palsize; i++)
+      {
+        Json::Value rgba(Json::arrayValue);
+        for (unsigned int c=0; c<4; c++)
+          rgba.append(Json::Value(palette[i][c]));
+        pal.append(rgba);
+      }
+      apng_obj["palette"] = pal;
+    }
+    if (trns_gray >= 0)
+      apng_obj["transparent_gray"] = Json::Value(trns_gray);
+  }
+}
+
+/* Only frames first..last (0-based, inclusive) are decoded. Extracted frames
+ * are raw and never depend on earlier frames, so with first > 0 the reader
+ * seeks straight to that frame's fcTL using the index from ProbeAPNG().
+ * Decoding stops as soon as frame last is complete. When that is the first
+ * frame its blend op is always SOURCE, so it is decoded straight into the
+ * output canvas and only one canvas is allocated.
+ */
+int LoadAPNG(char * szIn, unsigned int first, unsigned int last)
 {
   FILE         * f;
   unsigned int   id, i, j, w, h, w0, h0, x0, y0;
@@ -186,14 +473,21 @@ int LoadAPNG(char * szIn)
   unsigned int   flag_fctl = 0;
   unsigned int   flag_idat = 0;
   unsigned int   flag_info = 0;
+  unsigned int   frame_index = 0;
+  unsigned int   one_canvas = (first == 0 && last == 0);
   APNGFrame      frameRaw = {0};
   APNGFrame      frameCur = {0};
   APNGFrame      frameNext = {0};
   int            res = 0;
+  std::chrono::steady_clock::time_point t_frame = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point t_compose;
 
   printf("Reading '%s'...\n", szIn);
 
-  if ((f = fopen(szIn, "rb")) != 0)
+  if (first > 0 && (ProbeAPNG(szIn) != 0 || first >= frames_info.size()))
+    return 1;
+
+  if ((f = pipe_open_in(szIn, first > 0)) != 0)
   {
     if (fread(sig, 1, 8, f) == 8 && memcmp(sig, header, 8) == 0)
     {
@@ -202,15 +496,17 @@ int LoadAPNG(char * szIn)
       if (id == id_IHDR && chunk_ihdr.size == 25)
       {
         pi = (unsigned int *)chunk_ihdr.p;
-        w0 = w = swap32(pi[2]);
-        h0 = h = swap32(pi[3]);
+        canvas_w = w0 = w = swap32(pi[2]);
+        canvas_h = h0 = h = swap32(pi[3]);
         x0 = 0;
         y0 = 0;
         delay_num = 1;
         delay_den = 10;
         dop = APNG_DISPOSE_OP_NONE;
         bop = APNG_BLEND_OP_SOURCE;
-        rowbytes = w * 4;
+        // byte 16 of the chunk is the bit depth, 17 the color type
+        keep_coltype_ihdr(chunk_ihdr.p[16], chunk_ihdr.p[17]);
+        rowbytes = w * out_bpp;
         imagesize = h * rowbytes;
 
         frameRaw.p = new unsigned char[imagesize];
@@ -220,12 +516,20 @@ int LoadAPNG(char * szIn)
 
         frameCur.w = w;
         frameCur.h = h;
-        frameCur.p = new unsigned char[imagesize];
-        frameCur.rows = new png_bytep[h * sizeof(png_bytep)];
-        for (j=0; j<h; ++j)
-          frameCur.rows[j] = frameCur.p + j * rowbytes;
+        if (one_canvas)
+        {
+          frameCur.p = frameRaw.p;
+          frameCur.rows = frameRaw.rows;
+        }
+        else
+        {
+          frameCur.p = new unsigned char[imagesize];
+          frameCur.rows = new png_bytep[h * sizeof(png_bytep)];
+          for (j=0; j<h; ++j)
+            frameCur.rows[j] = frameCur.p + j * rowbytes;
+        }
 
-        png_ptr  = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        png_ptr  = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, (png_voidp)"libpng read", ALLOC_PNG_MALLOC, ALLOC_PNG_FREE);
         info_ptr = png_create_info_struct(png_ptr);
         setjmp(png_jmpbuf(png_ptr));
         png_set_progressive_read_fn(png_ptr, (void *)&frameRaw, info_fn, row_fn, NULL);
@@ -242,15 +546,17 @@ int LoadAPNG(char * szIn)
           {
             flag_actl = 1;
             num_frames = swap32(pi[2]);
+            num_plays = swap32(pi[3]);
             delete[] chunk.p;
           }
           else
-          if (id == id_fcTL)
+          if (id == id_fcTL && !(flag_fctl && frame_index > last))
           {
             if (flag_fctl)
             {
               png_process_data(png_ptr, info_ptr, &footer[0], 12);
               png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+              t_compose = std::chrono::steady_clock::now();
 
               frameNext.p = new unsigned char[imagesize];
               frameNext.rows = new png_bytep[h * sizeof(png_bytep)];
@@ -269,6 +575,8 @@ int LoadAPNG(char * szIn)
               frameCur.h = h0;
               frameCur.delay_num = delay_num;
               frameCur.delay_den = delay_den;
+              trace_complete("decode", t_frame, t_compose, frames.size()+first+1);
+              trace_complete("compose", t_compose, std::chrono::steady_clock::now(), frames.size()+first+1);
               frames.push_back(frameCur);
 
               if (dop != APNG_DISPOSE_OP_PREVIOUS)
@@ -276,15 +584,18 @@ int LoadAPNG(char * szIn)
                 memcpy(frameNext.p, frameCur.p, imagesize);
                 if (dop == APNG_DISPOSE_OP_BACKGROUND)
                   for (j=0; j<h0; j++)
-                    memset(frameNext.rows[y0 + j] + x0*4, 0, w0*4);
+                    memset(frameNext.rows[y0 + j] + x0*out_bpp, 0, w0*out_bpp);
               }
               frameCur.p = frameNext.p;
               frameCur.rows = frameNext.rows;
+            }
 
+            if (png_ptr == NULL)
+            {
               memcpy(chunk_ihdr.p + 8, chunk.p + 12, 8);
               recalc_crc(chunk_ihdr.p, chunk_ihdr.size);
 
-              png_ptr  = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+              png_ptr  = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, (png_voidp)"libpng read", ALLOC_PNG_MALLOC, ALLOC_PNG_FREE);
               info_ptr = png_create_info_struct(png_ptr);
               setjmp(png_jmpbuf(png_ptr));
               png_set_progressive_read_fn(png_ptr, (void *)&frameRaw, info_fn, row_fn, NULL);
@@ -301,13 +612,26 @@ int LoadAPNG(char * szIn)
             delay_den = chunk.p[30]*256 + chunk.p[31];
             dop = chunk.p[32]; // dispose_op
             bop = chunk.p[33]; // blend_op
-            if (!flag_fctl)
+            if (frame_index == 0)
             {
               bop = APNG_BLEND_OP_SOURCE;
               if (dop == APNG_DISPOSE_OP_PREVIOUS)
                 dop = APNG_DISPOSE_OP_BACKGROUND;
             }
             flag_fctl = 1;
+            frame_index++;
+            t_frame = std::chrono::steady_clock::now();
+            delete[] chunk.p;
+          }
+          else
+          if (id == id_IDAT && !flag_idat && first > 0)
+          {
+            // all info chunks are known by now, jump to the first requested frame
+            flag_idat = 1;
+            flag_fctl = 0;
+            frame_index = first;
+            png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+            fseek(f, frames_info[first].offset, SEEK_SET);
             delete[] chunk.p;
           }
           else
@@ -343,11 +667,14 @@ int LoadAPNG(char * szIn)
             delete[] chunk.p;
           }
           else
-          if (id == id_IEND)
+          if (id == id_IEND || id == id_fcTL)
           {
+            // an fcTL only gets here once frame last is done
             png_process_data(png_ptr, info_ptr, &footer[0], 12);
+            t_compose = std::chrono::steady_clock::now();
 
-            compose_frame(frameCur.rows, frameRaw.rows, bop, w0, h0);
+            if (frameCur.p != frameRaw.p)
+              compose_frame(frameCur.rows, frameRaw.rows, bop, w0, h0);
             frameCur.blend_op = bop;
             frameCur.dispose_op = dop;
             frameCur.x = x0;
@@ -356,6 +683,8 @@ int LoadAPNG(char * szIn)
             frameCur.h = h0;
             frameCur.delay_num = delay_num;
             frameCur.delay_den = delay_den;
+            trace_complete("decode", t_frame, t_compose, frames.size()+first+1);
+            trace_complete("compose", t_compose, std::chrono::steady_clock::now(), frames.size()+first+1);
             frames.push_back(frameCur);
             delete[] chunk.p;
             break;
@@ -368,14 +697,25 @@ int LoadAPNG(char * szIn)
           }
           else
           {
+            if (id == id_oFFs && chunk.size == 21)
+            {
+              has_offs = (chunk.p[16] == 0);
+              offs_x = swap32(pi[2]);
+              offs_y = swap32(pi[3]);
+            }
+            if (!flag_idat)
+              keep_coltype_chunk(id, chunk.p + 8, chunk.size - 12, chunk_ihdr.p[16]);
             if (!flag_idat)
               info_chunks.push_back(chunk);
             else
               delete[] chunk.p;
           }
         }
-        delete[] frameRaw.rows;
-        delete[] frameRaw.p;
+        if (frames.empty() || frames.back().p != frameRaw.p)
+        {
+          delete[] frameRaw.rows;
+          delete[] frameRaw.p;
+        }
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
       }
       else
@@ -398,25 +738,240 @@ int LoadAPNG(char * szIn)
   return res;
 }
 
-void SavePNG(char * szOut, APNGFrame * frame)
+void write_vector_fn(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+  std::vector<unsigned char> * buf = (std::vector<unsigned char> *)png_get_io_ptr(png_ptr);
+  buf->insert(buf->end(), data, data + length);
+}
+
+void flush_vector_fn(png_structp png_ptr)
+{
+}
+
+// Writes the frame as a PNG file to f, or to buf when f is NULL.
+void EncodePNG(APNGFrame * frame, FILE * f, std::vector<unsigned char> * buf)
+{
+  png_structp  png_ptr  = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, (png_voidp)"libpng write", ALLOC_PNG_MALLOC, ALLOC_PNG_FREE);
+  png_infop    info_ptr = png_create_info_struct(png_ptr);
+  if (png_ptr != NULL && info_ptr != NULL && setjmp(png_jmpbuf(png_ptr)) == 0)
+  {
+    if (f)
+      png_init_io(png_ptr, f);
+    else
+      png_set_write_fn(png_ptr, buf, write_vector_fn, flush_vector_fn);
+    png_set_compression_level(png_ptr, 9);
+    png_set_IHDR(png_ptr, info_ptr, frame->w, frame->h, 8, out_coltype, 0, 0, 0);
+    if (out_coltype == 3)
+    {
+      png_color plte[256];
+      png_byte trns[256];
+      unsigned int ntrns = 0;
+      for (unsigned int i=0; i<palsize; i++)
+      {
+        plte[i].red = palette[i][0];
+        plte[i].green = palette[i][1];
+        plte[i].blue = palette[i][2];
+        trns[i] = palette[i][3];
+        if (trns[i] != 255)
+          ntrns = i + 1;
+      }
+      png_set_PLTE(png_ptr, info_ptr, plte, palsize);
+      if (ntrns)
+        png_set_tRNS(png_ptr, info_ptr, trns, ntrns, NULL);
+    }
+    if (trns_gray >= 0)
+    {
+      png_color_16 trans = {0};
+      trans.gray = (png_uint_16)trns_gray;
+      png_set_tRNS(png_ptr, info_ptr, NULL, 0, &trans);
+    }
+    png_write_info(png_ptr, info_ptr);
+    png_write_image(png_ptr, frame->rows);
+    png_write_end(png_ptr, info_ptr);
+  }
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+// Returns the size of the file written.
+long SavePNG(char * szOut, APNGFrame * frame)
 {
   FILE * f;
+  long size = 0;
   if ((f = fopen(szOut, "wb")) != 0)
   {
-    png_structp  png_ptr  = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop    info_ptr = png_create_info_struct(png_ptr);
-    if (png_ptr != NULL && info_ptr != NULL && setjmp(png_jmpbuf(png_ptr)) == 0)
+    EncodePNG(frame, f, NULL);
+    size = ftell(f);
+    fclose(f);
+  }
+  return size;
+}
+
+/* With - as name everything goes to stdout as one stream: a signature, then
+ * records of a 4 byte big-endian length, a 4 byte type and the data. An
+ * FRME record holds one frame as a PNG file, in order, META the metadata
+ * json and DONE, empty, ends the stream.
+ */
+unsigned char stream_sig[8] = {137, 65, 68, 83, 13, 10, 26, 10};
+
+void WriteRecord(FILE * f, const char * type, const void * data, unsigned int length)
+{
+  unsigned char buf[4];
+  png_save_uint_32(buf, length);
+  fwrite(buf, 1, 4, f);
+  fwrite(type, 1, 4, f);
+  if (length)
+    fwrite(data, 1, length, f);
+}
+
+// Returns the size of the PNG file written.
+long StreamPNG(FILE * f, APNGFrame * frame)
+{
+  std::vector<unsigned char> buf;
+  EncodePNG(frame, NULL, &buf);
+  if (buf.empty())
+    return 0;
+  WriteRecord(f, "FRME", &buf[0], buf.size());
+  return buf.size();
+}
+
+/* Number of distinct RGBA colors of a frame, all fully transparent pixels
+ * counted as one. A cheap hint for choosing lossless or lossy encoding.
+ */
+unsigned int CountColors(APNGFrame * frame)
+{
+  unsigned int i, j, n = frame->w * frame->h;
+  std::vector<unsigned int> pixels(n);
+
+  for (j=0; j<frame->h; j++)
+  for (i=0; i<frame->w; i++)
+  {
+    unsigned char * px = frame->rows[j] + i*out_bpp;
+    unsigned char rgba[4];
+    if (out_coltype == 3)
+      memcpy(rgba, palette[px[0]], 4);
+    else
+    if (out_bpp != 4)
     {
-      png_init_io(png_ptr, f);
-      png_set_compression_level(png_ptr, 9);
-      png_set_IHDR(png_ptr, info_ptr, frame->w, frame->h, 8, 6, 0, 0, 0);
-      png_write_info(png_ptr, info_ptr);
-      png_write_image(png_ptr, frame->rows);
-      png_write_end(png_ptr, info_ptr);
+      rgba[0] = rgba[1] = rgba[2] = px[0];
+      rgba[3] = (out_bpp == 2) ? px[1] : ((int)px[0] == trns_gray) ? 0 : 255;
     }
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(f);
+    else
+      memcpy(rgba, px, 4);
+    pixels[j*frame->w + i] = rgba[3] ? (rgba[0] | (rgba[1] << 8) | (rgba[2] << 16) | ((unsigned int)rgba[3] << 24)) : 0;
   }
+  std::sort(pixels.begin(), pixels.end());
+  return std::unique(pixels.begin(), pixels.end()) - pixels.begin();
+}
+
+/* --pack: all frames in one file instead of PNG files and the json, laid out
+ * so a reader can mmap it and use the pixels in place. Little-endian.
+ *
+ * Header, 80 bytes:
+ *    0  "APNGPACK"
+ *    8  u32 version (1), u32 header size (80), u32 table entry size (40), u32 frame count
+ *   24  u32 canvas width, u32 canvas height, u32 loops, u32 number of the first frame (1-based)
+ *   40  u32 PNG color type of the pixels (6: RGBA, with --keep-colortype 3: palette
+ *       indices, 0: gray, 4: gray and alpha; 8 bits each), u32 flags (1: x and y
+ *       offset set, 2: transparent gray level set)
+ *   48  u32 x offset, u32 y offset (see apngopt --keep-offset), u64 file size
+ *   64  u64 palette offset (0 without palette), u32 palette entries, u32 transparent gray level
+ * Then the frame table, one entry per frame:
+ *    0  u64 pixel offset, u32 row bytes, u32 width, u32 height, u32 x, u32 y
+ *   28  u16 delay_num, u16 delay_den, u8 blend_op, u8 dispose_op, u16 0
+ *   36  u32 colors (with --colors, else 0)
+ * The palette, 4 bytes RGBA per entry, and the pixels of every frame start
+ * at a multiple of 64 bytes, the rows of a frame follow each other without
+ * padding.
+ */
+const unsigned int cPackHeader = 80;
+const unsigned int cPackEntry = 40;
+const unsigned int cPackAlign = 64;
+
+unsigned long long pack_pos = 0;
+
+void put_le(unsigned char * p, unsigned long long v, unsigned int n)
+{
+  for (unsigned int i=0; i<n; i++, v>>=8)
+    p[i] = (unsigned char)v;
+}
+
+unsigned long long pack_align(unsigned long long n)
+{
+  return (n + cPackAlign - 1) & ~(unsigned long long)(cPackAlign - 1);
+}
+
+void pack_pad(FILE * f)
+{
+  static const unsigned char zero[cPackAlign] = {0};
+  unsigned long long end = pack_align(pack_pos);
+  fwrite(zero, 1, (size_t)(end - pack_pos), f);
+  pack_pos = end;
+}
+
+// The header and the frame table, colors has the color count of each frame or is empty.
+void WritePackHeader(FILE * f, unsigned int first, const vector<unsigned int> & colors)
+{
+  unsigned char header[cPackHeader] = {0};
+  vector<unsigned char> table(frames.size() * cPackEntry);
+  unsigned long long pal_pos = (out_coltype == 3) ? pack_align(cPackHeader + table.size()) : 0;
+  unsigned long long pos = (pal_pos) ? pack_align(pal_pos + palsize * 4) : pack_align(cPackHeader + table.size());
+
+  for (size_t i=0; i<frames.size(); i++)
+  {
+    unsigned char * e = &table[i * cPackEntry];
+    put_le(e, pos, 8);
+    put_le(e + 8, frames[i].w * out_bpp, 4);
+    put_le(e + 12, frames[i].w, 4);
+    put_le(e + 16, frames[i].h, 4);
+    put_le(e + 20, frames[i].x, 4);
+    put_le(e + 24, frames[i].y, 4);
+    put_le(e + 28, frames[i].delay_num, 2);
+    put_le(e + 30, frames[i].delay_den, 2);
+    e[32] = frames[i].blend_op;
+    e[33] = frames[i].dispose_op;
+    put_le(e + 36, (colors.empty()) ? 0 : colors[i], 4);
+    pos = pack_align(pos + (unsigned long long)frames[i].w * frames[i].h * out_bpp);
+  }
+
+  memcpy(header, "APNGPACK", 8);
+  put_le(header + 8, 1, 4);
+  put_le(header + 12, cPackHeader, 4);
+  put_le(header + 16, cPackEntry, 4);
+  put_le(header + 20, frames.size(), 4);
+  put_le(header + 24, canvas_w, 4);
+  put_le(header + 28, canvas_h, 4);
+  put_le(header + 32, num_plays, 4);
+  put_le(header + 36, first + 1, 4);
+  put_le(header + 40, out_coltype, 4);
+  put_le(header + 44, ((has_offs) ? 1 : 0) | ((trns_gray >= 0) ? 2 : 0), 4);
+  put_le(header + 48, (has_offs) ? offs_x : 0, 4);
+  put_le(header + 52, (has_offs) ? offs_y : 0, 4);
+  put_le(header + 56, pos, 8);
+  put_le(header + 64, pal_pos, 8);
+  put_le(header + 72, (out_coltype == 3) ? palsize : 0, 4);
+  put_le(header + 76, (trns_gray >= 0) ? trns_gray : 0, 4);
+
+  fwrite(header, 1, cPackHeader, f);
+  if (!table.empty())
+    fwrite(&table[0], 1, table.size(), f);
+  pack_pos = cPackHeader + table.size();
+  if (pal_pos)
+  {
+    pack_pad(f);
+    fwrite(palette, 4, palsize, f);
+    pack_pos += palsize * 4;
+  }
+  pack_pad(f);
+}
+
+// Returns the size of the pixels written.
+long WritePackFrame(FILE * f, APNGFrame * frame)
+{
+  for (unsigned int j=0; j<frame->h; j++)
+    fwrite(frame->rows[j], 1, frame->w * out_bpp, f);
+  pack_pos += (unsigned long long)frame->w * frame->h * out_bpp;
+  pack_pad(f);
+  return (long)frame->w * frame->h * out_bpp;
 }
 
 void SaveTXT(char * szOut, APNGFrame * frame)
@@ -432,21 +987,99 @@ void SaveTXT(char * szOut, APNGFrame * frame)
 int main(int argc, char** argv)
 {
   unsigned int i, j, len;
-  char * szInput;
-  char * szOutPrefix;
+  char * szInput = NULL;
+  char * szOutPrefix = NULL;
   char   szPath[256];
   const char * szFilename;
   char   szOut[256];
+  int    probe = 0;
+  int    colors = 0;
+  int    quiet = 0;
+  char * szStats = NULL;
+  char * szTrace = NULL;
+  char * szPack = NULL;
+  FILE * out = NULL;
+  FILE * pack = NULL;
+  unsigned int first = 0;
+  unsigned int last = (unsigned int)-1;
   Json::Value apng_obj;
   Json::Value frames_vec(Json::arrayValue);
 
-  printf("\nAPNG Disassembler 2.6\n\n");
+  for (i=1; i<(unsigned int)argc; i++)
+  {
+    if (strcmp(argv[i], "--probe") == 0)
+      probe = 1;
+    else
+    if (strcmp(argv[i], "--first-frame") == 0)
+      first = last = 0;
+    else
+    if (strcmp(argv[i], "--colors") == 0)
+      colors = 1;
+    else
+    if (strcmp(argv[i], "--quiet") == 0)
+      quiet = 1;
+    else
+    if (strcmp(argv[i], "--trace") == 0 && i+1 < (unsigned int)argc)
+    {
+      szTrace = argv[++i];
+      trace_start("apngdisraw");
+    }
+    else
+    if (strcmp(argv[i], "--stats") == 0 && i+1 < (unsigned int)argc)
+    {
+      szStats = argv[++i];
+      stats.enabled = true;
+    }
+    else
+    if (strcmp(argv[i], "--keep-colortype") == 0)
+      keep_coltype = 1;
+    else
+    if (strcmp(argv[i], "--pack") == 0 && i+1 < (unsigned int)argc)
+      szPack = argv[++i];
+    else
+    if (strcmp(argv[i], "--frames") == 0 && i+1 < (unsigned int)argc)
+    {
+      // 1-based and inclusive, like the numbers in the extracted file names
+      unsigned int a = 0, b = 0;
+      int n = sscanf(argv[++i], "%u-%u", &a, &b);
+      if (n < 1 || a == 0 || (n == 2 && b < a))
+      {
+        printf("Invalid frame range: '%s'\n", argv[i]);
+        return 1;
+      }
+      first = a - 1;
+      last = (n == 2) ? b - 1 : a - 1;
+    }
+    else
+    if (szInput == NULL)
+      szInput = argv[i];
+    else
+    if (szOutPrefix == NULL)
+      szOutPrefix = argv[i];
+  }
 
-  if (argc > 1)
-    szInput = argv[1];
+  // before the first message, they would end up in the output
+  if (szPack != NULL && pipe_is_std(szPack) && !probe)
+    pack = pipe_stdout();
   else
+  if (szOutPrefix != NULL && pipe_is_std(szOutPrefix) && !probe && szPack == NULL)
+  {
+    out = pipe_stdout();
+    szOutPrefix = NULL;
+  }
+
+  if (!probe)
+    printf("\nAPNG Disassembler 2.6\n\n");
+
+  if (szInput == NULL)
+  {
+    printf("Usage: apngdis [--probe | --first-frame | --frames a-b] [--colors] [--keep-colortype] [--pack file] [--stats file] [--trace file] [--quiet] anim.png [name]\n");
+    printf("anim.png can be - for stdin, name - for one stream of all frames to stdout.\n");
+    return 1;
+  }
+  if (strlen(szInput) + ((szOutPrefix) ? strlen(szOutPrefix) : 0) + 32 >= sizeof(szPath))
   {
-    printf("Usage: apngdis anim.png [name]\n");
+    printf("Error: path too long: '%s'\n", szInput);
     return 1;
   }
   strcpy(szPath, szInput);
@@ -457,10 +1090,8 @@ int main(int argc, char** argv)
   }
   szPath[j] = 0;
 
-  if (argc > 2)
+  if (szOutPrefix != NULL)
   {
-    szOutPrefix = argv[2];
-
     for (i=j=0; szOutPrefix[i]!=0; i++)
     {
       if (szOutPrefix[i] == '\\' || szOutPrefix[i] == '/' || szOutPrefix[i] == ':')
@@ -477,45 +1108,162 @@ int main(int argc, char** argv)
     strcat(szPath, "apngframe");
   }
 
-  if (LoadAPNG(szInput) != 0)
+  if (probe)
+  {
+    stats_begin("ProbeAPNG");
+    int res = ProbeAPNG(szInput);
+    stats_end();
+    if (res != 0)
+    {
+      fprintf(stderr, "ProbeAPNG() failed: '%s'\n", szInput);
+      return 1;
+    }
+
+    len = sprintf(szOut, "%d", num_frames);
+    for (i=0; i<frames_info.size(); ++i)
+    {
+      sprintf(szOut, "%s%.*d.png", szFilename, len, i+1);
+      Json::Value frame_obj = frame_metadata(szOut, frames_info[i]);
+      frame_obj["data_size"] = Json::Value(frames_info[i].data_size);
+      frame_obj["offset"] = Json::Value((Json::UInt64)frames_info[i].offset);
+      frame_obj["key"] = Json::Value(frames_info[i].key != 0);
+      frames_vec.append(frame_obj);
+    }
+    animation_metadata(apng_obj);
+    apng_obj["frames"] = frames_vec;
+
+    Json::StyledWriter writer;
+    cout << writer.write( apng_obj ) << endl;
+    if (szStats && stats_write(szStats, "apngdisraw", szInput) != 0)
+      return 1;
+    if (szTrace && trace_write(szTrace) != 0)
+      return 1;
+    return 0;
+  }
+
+  stats_begin("LoadAPNG");
+  int res = LoadAPNG(szInput, first, last);
+  stats_end();
+  if (res != 0)
   {
     printf("LoadAPNG() failed: '%s'\n ", szInput);
     return 1;
   }
 
+  if (out)
+    fwrite(stream_sig, 1, 8, out);
+
+  vector<unsigned int> frame_colors;
+  if (szPack)
+  {
+    if (!pack && (pack = fopen(szPack, "wb")) == 0)
+    {
+      printf("Error: couldn't open '%s' for writing\n", szPack);
+      return 1;
+    }
+    // the table comes first, so the colors are counted before
+    if (colors)
+    {
+      stats_begin("CountColors");
+      for (i=0; i<frames.size(); ++i)
+        frame_colors.push_back(CountColors(&frames[i]));
+      stats_end();
+    }
+    stats_begin("SavePack");
+    WritePackHeader(pack, first, frame_colors);
+    stats_end();
+  }
+
   len = sprintf(szOut, "%d", num_frames);
   for (i=0; i<frames.size(); ++i)
   {
-    printf("extracting frame %d of %d\n", i+1, num_frames);
-
-    sprintf(szOut, "%s%.*d.png", szPath, len, i+1);
-    SavePNG(szOut, &frames[i]);
-
-    Json::Value frame_metadata;
-    sprintf(szOut, "%s%.*d.png", szFilename, len, i+1);
-    frame_metadata["src"] = Json::Value(szOut);
-    frame_metadata["delay_num"] = Json::Value(frames[i].delay_num);
-    frame_metadata["delay_den"] = Json::Value(frames[i].delay_den);
-    frame_metadata["x"] = Json::Value(frames[i].x);
-    frame_metadata["y"] = Json::Value(frames[i].y);
-    frame_metadata["blend_op"] = Json::Value(frames[i].blend_op);
-    frame_metadata["dispose_op"] = Json::Value(frames[i].dispose_op);
-    frames_vec.append(frame_metadata);
+    if (!quiet)
+      printf("extracting frame %d of %d\n", first+i+1, num_frames);
+
+    sprintf(szOut, "%s%.*d.png", szPath, len, first+i+1);
+    std::chrono::steady_clock::time_point t_save = std::chrono::steady_clock::now();
+    long size;
+    if (pack)
+    {
+      stats_begin("SavePack");
+      size = WritePackFrame(pack, &frames[i]);
+      stats_end();
+    }
+    else
+    {
+      stats_begin("SavePNG");
+      size = (out) ? StreamPNG(out, &frames[i]) : SavePNG(szOut, &frames[i]);
+      stats_end();
+    }
+    stats_record("frames", "\"frame\": %d, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, \"area\": %d, \"dispose_op\": %d, \"blend_op\": %d, \"save_ms\": %.3f, \"size\": %ld",
+                 first+i+1, frames[i].x, frames[i].y, frames[i].w, frames[i].h, frames[i].w*frames[i].h, frames[i].dispose_op, frames[i].blend_op,
+                 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_save).count(), size);
+
+    FRAMEINFO info = {0};
+    info.x = frames[i].x;
+    info.y = frames[i].y;
+    info.w = frames[i].w;
+    info.h = frames[i].h;
+    info.delay_num = frames[i].delay_num;
+    info.delay_den = frames[i].delay_den;
+    info.blend_op = frames[i].blend_op;
+    info.dispose_op = frames[i].dispose_op;
+    sprintf(szOut, "%s%.*d.png", szFilename, len, first+i+1);
+    Json::Value frame_obj = frame_metadata(szOut, info);
+    if (!frame_colors.empty())
+      frame_obj["colors"] = Json::Value(frame_colors[i]);
+    else
+    if (colors)
+    {
+      stats_begin("CountColors");
+      frame_obj["colors"] = Json::Value(CountColors(&frames[i]));
+      stats_end();
+    }
+    frames_vec.append(frame_obj);
 
     delete[] frames[i].rows;
     delete[] frames[i].p;
   }
   frames.clear();
+  animation_metadata(apng_obj);
   apng_obj["frames"] = frames_vec;
 
   Json::StyledWriter writer;
   std::string frames_metadata = writer.write( apng_obj );
-  cout << frames_metadata << endl;
-  ofstream metadata_f;
-  sprintf(szOut, "%s_metadata.json", szPath);
-  metadata_f.open (szOut);
-  metadata_f << frames_metadata;
-  metadata_f.close();
+  if (!quiet)
+    cout << frames_metadata << endl;
+  if (pack)
+  {
+    if (fflush(pack) != 0 || (pack != pipe_io.out && fclose(pack) != 0))
+    {
+      printf("Error: couldn't write '%s'\n", szPack);
+      return 1;
+    }
+  }
+  else
+  if (out)
+  {
+    WriteRecord(out, "META", frames_metadata.data(), frames_metadata.size());
+    WriteRecord(out, "DONE", NULL, 0);
+    if (fflush(out) != 0)
+    {
+      printf("Error: couldn't write to stdout\n");
+      return 1;
+    }
+  }
+  else
+  {
+    ofstream metadata_f;
+    sprintf(szOut, "%s_metadata.json", szPath);
+    metadata_f.open (szOut);
+    metadata_f << frames_metadata;
+    metadata_f.close();
+  }
+
+  if (szStats && stats_write(szStats, "apngdisraw", szInput) != 0)
+    return 1;
+  if (szTrace && trace_write(szTrace) != 0)
+    return 1;
 
   printf("all done\n");
 
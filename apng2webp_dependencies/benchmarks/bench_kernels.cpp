@@ -0,0 +1,204 @@
+/* Microbenchmarks for the pixel kernels of apngopt.
+ *
+ * apngopt.cpp is compiled into this file, so the kernels are measured as
+ * they are, with the same inlining. Every benchmark reports the bytes of
+ * canvas it goes through per second.
+ *
+ * Canvases are filled with blocks of 8x8 pixels in one of `colors` colors.
+ * The alpha modes are 0: opaque, 1: half the blocks fully transparent,
+ * 2: any alpha value. For get_rect() the second canvas differs from the
+ * first in a centered rect covering `dirty` percent of it.
+ *
+ * zlib license, like apngopt.
+ */
+#define APNGOPT_NO_MAIN
+#include "../apng2webp_apngopt/apngopt.cpp"
+
+#include <math.h>
+#include <benchmark/benchmark.h>
+
+static unsigned int hash(unsigned int x, unsigned int y, unsigned int seed)
+{
+  unsigned int h = x * 73856093u ^ y * 19349663u ^ seed * 83492791u;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  return h ^ (h >> 15);
+}
+
+static void fill_canvas(unsigned char * p, unsigned int w, unsigned int h, unsigned int bpp, unsigned int colors, unsigned int alpha, unsigned int seed)
+{
+  for (unsigned int j=0; j<h; j++)
+    for (unsigned int i=0; i<w; i++, p+=bpp)
+    {
+      unsigned int c = hash(i/8, j/8, seed) % colors;
+      unsigned int rgb = hash(c, 0, 1);
+      unsigned char px[4] = { (unsigned char)rgb, (unsigned char)(rgb >> 8), (unsigned char)(rgb >> 16), 255 };
+      if (alpha == 1 && (hash(i/8, j/8, seed + 1) & 1))
+        px[3] = 0;
+      else
+      if (alpha == 2)
+        px[3] = (unsigned char)(hash(i/8, j/8, seed + 2) >> 8);
+      memcpy(p, px + 4 - bpp, bpp);
+    }
+}
+
+static void make_frames(std::vector<APNGFrame>& frames, unsigned int num, unsigned int w, unsigned int h, unsigned int colors, unsigned int alpha)
+{
+  frames.resize(num);
+  for (unsigned int i=0; i<num; i++)
+  {
+    frames[i].w = w;
+    frames[i].h = h;
+    frames[i].delay_num = 1;
+    frames[i].delay_den = 10;
+    frames[i].p = new unsigned char[w * h * 4];
+    frames[i].rows = new png_bytep[h];
+    for (unsigned int j=0; j<h; j++)
+      frames[i].rows[j] = frames[i].p + j * w * 4;
+    fill_canvas(frames[i].p, w, h, 4, colors, alpha, i);
+  }
+}
+
+static void free_frames(std::vector<APNGFrame>& frames)
+{
+  for (size_t i=0; i<frames.size(); i++)
+  {
+    delete[] frames[i].rows;
+    delete[] frames[i].p;
+  }
+  frames.clear();
+}
+
+// args: canvas side, blend op, alpha mode
+static void BM_compose_frame(benchmark::State& state)
+{
+  unsigned int side = state.range(0);
+  unsigned int size = side * side * 4;
+  std::vector<APNGFrame> frames, source;
+  make_frames(frames, 2, side, side, 256, state.range(2));
+  make_frames(source, 1, side, side, 256, state.range(2));
+
+  for (auto _ : state)
+  {
+    // the canvas is composed in place
+    state.PauseTiming();
+    memcpy(frames[0].p, source[0].p, size);
+    state.ResumeTiming();
+    compose_frame(frames[0].rows, frames[1].rows, state.range(1), 0, 0, side, side);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+  free_frames(frames);
+  free_frames(source);
+}
+BENCHMARK(BM_compose_frame)->ArgsProduct({{256, 1024}, {0, 1}, {0, 1, 2}});
+
+// args: canvas side, alpha mode
+static void BM_optim_dirty(benchmark::State& state)
+{
+  unsigned int side = state.range(0);
+  unsigned int size = side * side * 4;
+  std::vector<APNGFrame> frames, source;
+  make_frames(frames, 4, side, side, 256, state.range(1));
+  make_frames(source, 4, side, side, 256, state.range(1));
+
+  for (auto _ : state)
+  {
+    // the pass changes the frames
+    state.PauseTiming();
+    for (size_t i=0; i<frames.size(); i++)
+      memcpy(frames[i].p, source[i].p, size);
+    state.ResumeTiming();
+    optim_dirty(frames);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * frames.size() * size);
+  free_frames(frames);
+  free_frames(source);
+}
+BENCHMARK(BM_optim_dirty)->ArgsProduct({{256, 1024}, {0, 1, 2}});
+
+// args: canvas side, colors, alpha mode. Up to 256 colors ends in the palette mapping.
+static void BM_optim_downconvert(benchmark::State& state)
+{
+  unsigned int side = state.range(0);
+  unsigned int size = side * side * 4;
+  unsigned int coltype;
+  std::vector<APNGFrame> frames, source;
+  make_frames(frames, 4, side, side, state.range(1), state.range(2));
+  make_frames(source, 4, side, side, state.range(1), state.range(2));
+
+  for (auto _ : state)
+  {
+    state.PauseTiming();
+    for (size_t i=0; i<frames.size(); i++)
+      memcpy(frames[i].p, source[i].p, size);
+    state.ResumeTiming();
+    optim_downconvert(frames, coltype);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * frames.size() * size);
+  state.counters["coltype"] = coltype;
+  free_frames(frames);
+  free_frames(source);
+}
+BENCHMARK(BM_optim_downconvert)->ArgsProduct({{256, 1024}, {16, 256, 100000}, {0, 1}});
+
+// args: canvas side, bpp. Only the filter choice, the rows are not compressed.
+static void BM_process_rect(benchmark::State& state)
+{
+  unsigned int side = state.range(0);
+  unsigned int bpp = state.range(1);
+  unsigned int rowbytes = side * bpp;
+  std::vector<unsigned char> image(rowbytes * side);
+  std::vector<unsigned char> rows((rowbytes + 1) * side);
+  fill_canvas(&image[0], side, side, bpp, 256, 2, 0);
+  op_init(rowbytes, (rowbytes + 1) * side);
+
+  for (auto _ : state)
+  {
+    process_rect(&image[0], rowbytes, bpp, rowbytes, side, &rows[0]);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * rowbytes * side);
+  op_free();
+}
+BENCHMARK(BM_process_rect)->ArgsProduct({{256, 1024}, {1, 2, 3, 4}});
+
+// args: canvas side, bpp, dirty percent. Includes the two trial deflates of the rect, like in save_apng().
+static void BM_get_rect(benchmark::State& state)
+{
+  unsigned int side = state.range(0);
+  unsigned int bpp = state.range(1);
+  unsigned int rowbytes = side * bpp;
+  unsigned int imagesize = rowbytes * side;
+  unsigned int zbuf_size = (rowbytes + 1) * side;
+  zbuf_size += ((zbuf_size + 7) >> 3) + ((zbuf_size + 63) >> 6) + 11;
+  std::vector<unsigned char> image1(imagesize), image2(imagesize), temp(imagesize);
+  fill_canvas(&image1[0], side, side, bpp, 256, 1, 0);
+  fill_canvas(&image2[0], side, side, bpp, 256, 1, 1);
+
+  // only a centered rect of the second canvas differs from the first
+  unsigned int dirty = (unsigned int)(side * sqrt(state.range(2) / 100.0));
+  unsigned int d0 = (side - dirty) / 2;
+  for (unsigned int j=0; j<side; j++)
+    if (j < d0 || j >= d0 + dirty)
+      memcpy(&image2[j * rowbytes], &image1[j * rowbytes], rowbytes);
+    else
+    {
+      memcpy(&image2[j * rowbytes], &image1[j * rowbytes], d0 * bpp);
+      memcpy(&image2[j * rowbytes + (d0 + dirty) * bpp], &image1[j * rowbytes + (d0 + dirty) * bpp], (side - d0 - dirty) * bpp);
+    }
+
+  op_init(rowbytes, zbuf_size);
+  for (auto _ : state)
+  {
+    get_rect(side, side, &image1[0], &image2[0], &temp[0], bpp, rowbytes, zbuf_size, 1, 0, 0);
+    benchmark::DoNotOptimize(op[0].size);
+  }
+  state.SetBytesProcessed(state.iterations() * imagesize);
+  op_free();
+}
+BENCHMARK(BM_get_rect)->ArgsProduct({{256, 1024}, {1, 2, 3, 4}, {1, 10, 100}});
+
+BENCHMARK_MAIN();
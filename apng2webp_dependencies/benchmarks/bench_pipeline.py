@@ -0,0 +1,157 @@
+#!/usr/bin/env python
+#-*- coding:utf-8 -*-
+
+# Runs apng2webp over examples/apng and a few synthetic inputs of growing
+# size, and writes the wall time, cpu time and peak memory of every stage as
+# JSON, so runs can be compared across commits. With --sweep it runs series
+# of synthetic inputs (see synth_apng.py) that differ in one parameter
+# instead; each result holds its parameters, to plot a stage against them.
+# The apng2webp_apngopt and apngdisraw to measure are taken from --bin-dir
+# (or PATH), cwebp from PATH.
+
+import argparse
+import glob
+import json
+import os
+import platform
+import shutil
+import subprocess
+import sys
+import tempfile
+from os import path
+
+from synth_apng import write_apng
+
+here = path.dirname(path.abspath(__file__))
+root = path.dirname(path.dirname(here))
+driver = path.join(root, 'apng2webp', 'apng2webp.py')
+
+# name and synth_apng.write_apng() parameters
+synthetic_inputs = [
+    ('synth_small', dict(width=160, height=120, frames=20)),
+    ('synth_medium', dict(width=480, height=360, frames=60)),
+    ('synth_large', dict(width=1280, height=720, frames=60)),
+]
+
+# --sweep: inputs that differ in one parameter, to see how each stage scales with it
+sweeps = {
+    'size': [('size_%d' % w, dict(width=w, height=w * 9 // 16, frames=30)) for w in (256, 512, 1024, 2048, 3840)],
+    'frames': [('frames_%d' % n, dict(width=320, height=180, frames=n, delta=0.01)) for n in (10, 100, 1000, 10000)],
+    'delta': [('delta_%g' % d, dict(width=640, height=360, frames=30, delta=d)) for d in (0.001, 0.01, 0.1, 1.0)],
+    'alpha': [('alpha_%s' % a, dict(width=640, height=360, frames=30, alpha=a)) for a in ('none', 'binary', 'heavy')],
+    'color_type': [('color_type_%s' % t, dict(width=640, height=360, frames=30, color_type=t, colors=200)) for t in ('rgba', 'rgb', 'palette', 'gray')],
+    'colors': [('colors_%d' % c, dict(width=640, height=360, frames=30, colors=c)) for c in (2, 16, 256, 4096)],
+}
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+    if n == 0:
+        return 0.0
+    if n & 1:
+        return values[n // 2]
+    return (values[n // 2 - 1] + values[n // 2]) / 2.0
+
+def git_commit():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'], cwd=root, stderr=open(os.devnull, 'w')).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def run(input_file, output_file, stats_file, extra_args):
+    with open(os.devnull, 'w') as devnull:
+        subprocess.check_call([sys.executable, driver, '--stats', stats_file] + extra_args + [input_file, output_file], stdout=devnull)
+    with open(stats_file, 'r') as f:
+        return json.load(f)
+
+def summary(runs):
+    # The median time and the highest peak memory of every stage over the runs.
+    stages = []
+    for stage in runs[0]['stages']:
+        same = [s for r in runs for s in r['stages'] if s['tool'] == stage['tool'] and s['name'] == stage['name']]
+        summary_stage = {
+            'tool': stage['tool'],
+            'name': stage['name'],
+            'calls': stage['calls'],
+            'wall_ms': round(median([s['wall_ms'] for s in same]), 3),
+            'cpu_ms': round(median([s['cpu_ms'] for s in same]), 3),
+            'peak_rss_kb': max(s['peak_rss_kb'] for s in same),
+        }
+        if 'peak_heap_kb' in stage:
+            # tools built with TRACK_ALLOC
+            summary_stage['peak_heap_kb'] = max(s['peak_heap_kb'] for s in same)
+        stages.append(summary_stage)
+    return {
+        'wall_ms': round(median([r['wall_ms'] for r in runs]), 3),
+        'output_size': runs[0]['output_size'],
+        'stages': stages,
+    }
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the apng2webp pipeline stage by stage.')
+    parser.add_argument('inputs', nargs='*', help='APNG files to convert. Defaults to examples/apng/*.png and the synthetic inputs.')
+    parser.add_argument('-o', '--output', default=None, help='Write the results to this JSON file instead of stdout.')
+    parser.add_argument('-r', '--repeat', type=int, default=3, help='Runs per input. The summary holds the median times.')
+    parser.add_argument('--bin-dir', action='append', default=[], help='Directory with apng2webp_apngopt and apngdisraw. Can be given more than once.')
+    parser.add_argument('--no-synthetic', action='store_true', help='Leave out the synthetic inputs.')
+    parser.add_argument('--sweep', action='append', default=[], choices=sorted(sweeps), help='Only run the synthetic inputs that scale this parameter. Can be given more than once.')
+    parser.add_argument('--args', default='', help='Extra apng2webp arguments, as one string.')
+    args = parser.parse_args()
+
+    if args.repeat < 1:
+        parser.error('repeat must be at least 1')
+
+    if args.bin_dir:
+        os.environ['PATH'] = os.pathsep.join([path.abspath(d) for d in args.bin_dir] + [os.environ.get('PATH', '')])
+
+    workdir = tempfile.mkdtemp(prefix='apng2webp_bench_')
+    try:
+        # (path, synthetic parameters or None)
+        inputs = [(input_file, None) for input_file in args.inputs]
+        synthetic = []
+        if args.sweep:
+            for sweep in args.sweep:
+                synthetic += sweeps[sweep]
+        elif not inputs:
+            inputs = [(input_file, None) for input_file in sorted(glob.glob(path.join(root, 'examples', 'apng', '*.png')))]
+            if not args.no_synthetic:
+                synthetic = synthetic_inputs
+        for name, params in synthetic:
+            synth_file = path.join(workdir, name + '.png')
+            write_apng(synth_file, **params)
+            inputs.append((synth_file, params))
+
+        results = []
+        for input_file, params in inputs:
+            runs = []
+            for i in range(args.repeat):
+                runs.append(run(input_file, path.join(workdir, 'out.webp'), path.join(workdir, 'stats.json'), args.args.split()))
+            result = summary(runs)
+            result['input'] = path.basename(input_file)
+            result['input_size'] = path.getsize(input_file)
+            if params is not None:
+                result['synthetic'] = params
+            result['runs'] = runs
+            results.append(result)
+            sys.stderr.write('%-40s %10.1f ms %10d bytes\n' % (result['input'], result['wall_ms'], result['output_size']))
+    finally:
+        shutil.rmtree(workdir)
+
+    report = {
+        'commit': git_commit(),
+        'platform': platform.platform(),
+        'python': platform.python_version(),
+        'repeat': args.repeat,
+        'args': args.args,
+        'results': results,
+    }
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2)
+            f.write('\n')
+    else:
+        json.dump(report, sys.stdout, indent=2)
+        sys.stdout.write('\n')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,420 @@
+#!/usr/bin/env python
+#-*- coding:utf-8 -*-
+
+# Checks apng2webp_apngopt and apngdisraw on APNG files against the
+# baselines in baselines.json, for the CTest tests of CMakeLists.txt.
+#
+# --check identity: the apngopt output, the frames apngdisraw extracts from
+# it and their metadata must be the same as the reference, byte for byte.
+# Compressed bytes depend on the zlib version, so with another zlib than
+# the one the reference was recorded with the decoded pixels are compared
+# instead. The default configuration is also run through stdin and stdout
+# (- as the file names), which must give the same output as the files, and
+# extracted with apngdisraw --pack, which must hold the same pixels and
+# metadata, also with --keep-colortype once expanded through its palette,
+# whose color type and palette --probe must report too.
+#
+# --check perf: the cpu time and peak memory of every stage (best of
+# --repeat runs) must stay under the baseline plus the tolerance. Timings
+# are kept per build type, and are those of the machine that recorded them.
+# Without timings for the build type the test is skipped (exit code 77).
+#
+# An input named after an entry of `synthetic` instead of a file is written
+# by synth_apng.py first. The examples only have unfiltered rects, these
+# cover the filtered ones. CMakeLists.txt runs the lossy config on those
+# only.
+#
+# --update records the reference and the timings of this machine instead.
+# Only needs python and the tools, no network.
+
+import argparse
+import array
+import glob
+import hashlib
+import json
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+from os import path
+
+here = path.dirname(path.abspath(__file__))
+baseline_file = path.join(here, 'baselines.json')
+sys.path.insert(0, here)
+import synth_apng
+
+# name: apngopt arguments
+configs = {
+    'default': [],
+    'stream': ['--stream'],
+    # all the lossy passes at once
+    'lossy': ['--scale', '2', '--crop', '--merge-threshold', '8', '--merge-fraction', '0.01', '--rect-threshold', '4',
+              '--split', '--max-fps', '10', '--kmax', '10'],
+}
+
+# name: synth_apng.write_apng arguments
+synthetic = {
+    'synth_rgba.png': dict(width=200, height=120, frames=60, color_type='rgba', alpha='binary', delta=0.05),
+}
+
+SKIPPED = 77
+
+def zlib_version():
+    return getattr(zlib, 'ZLIB_RUNTIME_VERSION', zlib.ZLIB_VERSION)
+
+def sha256(data):
+    return hashlib.sha256(data).hexdigest()
+
+def file_sha256(file_name):
+    with open(file_name, 'rb') as f:
+        return sha256(f.read())
+
+def _paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    if pb <= pc:
+        return b
+    return c
+
+def png_pixels(file_name):
+    # The RGBA pixels of a non-interlaced 8 bit RGBA PNG file, as apngdisraw writes them.
+    with open(file_name, 'rb') as f:
+        data = f.read()
+    pos = 8
+    idat = []
+    while pos + 8 <= len(data):
+        length, name = struct.unpack('>I4s', data[pos:pos+8])
+        if name == b'IHDR':
+            width, height, depth, color_type = struct.unpack('>IIBB', data[pos+8:pos+18])
+            if depth != 8 or color_type != 6:
+                raise ValueError('%s is not an 8 bit RGBA file' % file_name)
+        elif name == b'IDAT':
+            idat.append(data[pos+8:pos+8+length])
+        pos += 12 + length
+
+    raw = bytearray(zlib.decompress(b''.join(idat)))
+    stride = width * 4
+    pixels = bytearray(stride * height)
+    prev = bytearray(stride)
+    for y in range(height):
+        kind = raw[y * (stride + 1)]
+        row = raw[y * (stride + 1) + 1:(y + 1) * (stride + 1)]
+        for i in range(stride):
+            a = row[i - 4] if i >= 4 else 0
+            c = prev[i - 4] if i >= 4 else 0
+            if kind == 1:
+                row[i] = (row[i] + a) & 0xff
+            elif kind == 2:
+                row[i] = (row[i] + prev[i]) & 0xff
+            elif kind == 3:
+                row[i] = (row[i] + ((a + prev[i]) >> 1)) & 0xff
+            elif kind == 4:
+                row[i] = (row[i] + _paeth(a, prev[i], c)) & 0xff
+        pixels[y * stride:(y + 1) * stride] = row
+        prev = row
+    return bytes(pixels)
+
+def find_tool(bin_dirs, name):
+    for bin_dir in bin_dirs:
+        for exe in (name, name + '.exe'):
+            if path.isfile(path.join(bin_dir, exe)):
+                return path.join(bin_dir, exe)
+    return name
+
+def run_tools(bin_dirs, input_file, args, workdir):
+    # Runs apngopt and apngdisraw on its output. Returns their stages and the output files.
+    def tool(name):
+        return find_tool(bin_dirs, name)
+
+    for f in glob.glob(path.join(workdir, '*')):
+        os.remove(f)
+    opt_file = path.join(workdir, 'opt.png')
+    opt_stats = path.join(workdir, 'apngopt_stats.json')
+    dis_stats = path.join(workdir, 'apngdisraw_stats.json')
+    with open(os.devnull, 'w') as devnull:
+        subprocess.check_call([tool('apng2webp_apngopt'), '--quiet', '--stats', opt_stats] + args + [input_file, opt_file], stdout=devnull)
+        subprocess.check_call([tool('apngdisraw'), '--quiet', '--stats', dis_stats, opt_file], stdout=devnull)
+
+    stages = {}
+    for tool_name, stats_file in (('apngopt', opt_stats), ('apngdisraw', dis_stats)):
+        with open(stats_file, 'r') as f:
+            for stage in json.load(f)['stages']:
+                stages['%s %s' % (tool_name, stage['name'])] = stage
+    frames = sorted(path.basename(f) for f in glob.glob(path.join(workdir, 'apngframe*.png')))
+    return stages, opt_file, frames
+
+def run_pipe(bin_dirs, input_file, args):
+    # Runs apngopt and apngdisraw with - as the file names. Returns the apngopt
+    # output, the frames of the apngdisraw stream and its metadata.
+    with open(input_file, 'rb') as f, open(os.devnull, 'w') as devnull:
+        opt = subprocess.Popen([find_tool(bin_dirs, 'apng2webp_apngopt'), '--quiet'] + args + ['-', '-'], stdin=f, stdout=subprocess.PIPE, stderr=devnull).communicate()[0]
+    dis = subprocess.Popen([find_tool(bin_dirs, 'apngdisraw'), '--quiet', '-', '-'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=open(os.devnull, 'w')).communicate(opt)[0]
+
+    frames, metadata = [], None
+    if dis[:8] != b'\x89ADS\r\n\x1a\n':
+        return opt, frames, metadata
+    pos = 8
+    while pos + 8 <= len(dis):
+        length, kind = struct.unpack('>I4s', dis[pos:pos+8])
+        data = dis[pos+8:pos+8+length]
+        pos += 8 + length
+        if kind == b'FRME':
+            frames.append(data)
+        elif kind == b'META':
+            metadata = json.loads(data.decode('utf-8'))
+        elif kind == b'DONE':
+            break
+    return opt, frames, metadata
+
+def check_pipe(bin_dirs, input_file, args, workdir, opt_file, frames):
+    errors = []
+    opt, pipe_frames, metadata = run_pipe(bin_dirs, input_file, args)
+    with open(opt_file, 'rb') as f:
+        if opt != f.read():
+            errors.append('apngopt output through stdout differs')
+    if len(pipe_frames) != len(frames):
+        errors.append('%d frames in the apngdisraw stream instead of %d' % (len(pipe_frames), len(frames)))
+    else:
+        for name, data in zip(frames, pipe_frames):
+            with open(path.join(workdir, name), 'rb') as f:
+                if data != f.read():
+                    errors.append('%s differs in the apngdisraw stream' % name)
+    with open(path.join(workdir, 'apngframe_metadata.json'), 'r') as f:
+        if metadata != json.load(f):
+            errors.append('metadata differs in the apngdisraw stream')
+    return errors
+
+def read_pack(file_name):
+    # The header and the frames of an apngdisraw --pack file, each frame a dict with its pixels.
+    with open(file_name, 'rb') as f:
+        data = f.read()
+    if data[:8] != b'APNGPACK':
+        raise ValueError('%s is not a pack file' % file_name)
+    version, header_size, entry_size, count, width, height, loops, first, color_type, flags, x_offset, y_offset, size, palette_offset, palette_size, gray = struct.unpack('<12IQQ2I', data[8:80])
+    header = dict(version=version, width=width, height=height, loops=loops, first=first, color_type=color_type, size=size, file_size=len(data),
+                  palette_offset=palette_offset, palette=[data[palette_offset+i*4:palette_offset+i*4+4] for i in range(palette_size)])
+    if flags & 1:
+        header.update(x_offset=x_offset, y_offset=y_offset)
+    if flags & 2:
+        header.update(transparent_gray=gray)
+    frames = []
+    for i in range(count):
+        pos = header_size + i * entry_size
+        offset, stride, w, h, x, y, delay_num, delay_den, blend_op, dispose_op, zero, colors = struct.unpack('<Q5I2H2BHI', data[pos:pos+40])
+        frames.append(dict(offset=offset, stride=stride, w=w, h=h, x=x, y=y, delay_num=delay_num, delay_den=delay_den,
+                           blend_op=blend_op, dispose_op=dispose_op, pixels=data[offset:offset+stride*h]))
+    return header, frames
+
+def pack_rgba(header, frame):
+    # The pixels of a pack frame as RGBA, all fully transparent pixels 0.
+    px = frame['pixels']
+    if header['color_type'] == 3:
+        palette = [c if c[3:] != b'\x00' else b'\x00' * 4 for c in header['palette']]
+        return b''.join(palette[i] for i in bytearray(px))
+    if header['color_type'] in (0, 4):
+        bpp = 2 if header['color_type'] == 4 else 1
+        gray = header.get('transparent_gray', -1)
+        out = bytearray()
+        for i in range(0, len(px), bpp):
+            v = bytearray(px[i:i+bpp])
+            a = v[1] if bpp == 2 else 0 if v[0] == gray else 255
+            out += bytearray((v[0], v[0], v[0], a)) if a else bytearray(4)
+        return bytes(out)
+    words = array.array('I', px)
+    if sys.byteorder == 'big':
+        words.byteswap()
+    words = array.array('I', [w if w >> 24 else 0 for w in words])
+    if sys.byteorder == 'big':
+        words.byteswap()
+    return words.tobytes()
+
+def check_pack(bin_dirs, opt_file, workdir, frames, pixels):
+    errors = []
+    pack_file = path.join(workdir, 'frames.pack')
+    with open(os.devnull, 'w') as devnull:
+        subprocess.check_call([find_tool(bin_dirs, 'apngdisraw'), '--quiet', '--pack', pack_file, opt_file], stdout=devnull)
+    header, pack_frames = read_pack(pack_file)
+    with open(path.join(workdir, 'apngframe_metadata.json'), 'r') as f:
+        metadata = json.load(f)
+
+    if header['size'] != header['file_size']:
+        errors.append('pack file is %d bytes, its header says %d' % (header['file_size'], header['size']))
+    for key in ('width', 'height', 'loops', 'x_offset', 'y_offset'):
+        if header.get(key) != metadata.get(key):
+            errors.append('%s in the pack header differs' % key)
+    if len(pack_frames) != len(frames):
+        errors.append('%d frames in the pack instead of %d' % (len(pack_frames), len(frames)))
+        return errors
+    for name, meta, frame in zip(frames, metadata['frames'], pack_frames):
+        if frame['offset'] % 64:
+            errors.append('pixels of %s in the pack are not aligned' % name)
+        if any(frame[key] != meta[key] for key in ('x', 'y', 'w', 'h', 'delay_num', 'delay_den', 'blend_op', 'dispose_op')):
+            errors.append('table entry of %s in the pack differs' % name)
+        if sha256(frame['pixels']) != pixels.get(name):
+            errors.append('pixels of %s in the pack differ' % name)
+
+    keep_file = path.join(workdir, 'keep.pack')
+    with open(os.devnull, 'w') as devnull:
+        subprocess.check_call([find_tool(bin_dirs, 'apngdisraw'), '--quiet', '--keep-colortype', '--pack', keep_file, opt_file], stdout=devnull)
+    keep_header, keep_frames = read_pack(keep_file)
+    if keep_header['size'] != keep_header['file_size'] or keep_header['palette_offset'] % 64:
+        errors.append('--keep-colortype pack file is broken')
+    elif len(keep_frames) != len(pack_frames):
+        errors.append('%d frames in the --keep-colortype pack instead of %d' % (len(keep_frames), len(pack_frames)))
+    else:
+        for name, frame, keep in zip(frames, pack_frames, keep_frames):
+            if keep['offset'] % 64 or pack_rgba(keep_header, keep) != pack_rgba(header, frame):
+                errors.append('pixels of %s in the --keep-colortype pack differ' % name)
+
+    # --probe reads the color type and the palette without decoding
+    probe = json.loads(subprocess.check_output([find_tool(bin_dirs, 'apngdisraw'), '--quiet', '--probe', '--keep-colortype', opt_file]).decode('utf-8'))
+    if probe.get('color_type') != keep_header['color_type'] or probe.get('transparent_gray') != keep_header.get('transparent_gray') or \
+       probe.get('palette', []) != [list(bytearray(c)) for c in keep_header['palette']]:
+        errors.append('color type or palette of --probe --keep-colortype differs from the pack')
+    return errors
+
+def reference(workdir, opt_file, frames, pixels):
+    ref = {
+        'files': dict([('opt.png', file_sha256(opt_file))] + [(f, file_sha256(path.join(workdir, f))) for f in frames]),
+    }
+    with open(path.join(workdir, 'apngframe_metadata.json'), 'r') as f:
+        # parsed, the json formatting may differ between jsoncpp versions
+        ref['metadata'] = sha256(json.dumps(json.load(f), sort_keys=True).encode('utf-8'))
+    if pixels:
+        ref['pixels'] = dict((f, sha256(png_pixels(path.join(workdir, f)))) for f in frames)
+    return ref
+
+def check_identity(expected, workdir, opt_file, frames, same_zlib):
+    errors = []
+    got = reference(workdir, opt_file, frames, not same_zlib)
+    if got['metadata'] != expected['metadata']:
+        errors.append('frame metadata differs')
+    if sorted(frames) != sorted(f for f in expected['files'] if f != 'opt.png'):
+        errors.append('%d frames instead of %d' % (len(frames), len(expected['files']) - 1))
+    elif same_zlib:
+        for f in sorted(expected['files']):
+            if got['files'][f] != expected['files'][f]:
+                errors.append('%s differs' % f)
+    else:
+        for f in frames:
+            if got['pixels'][f] != expected['pixels'][f]:
+                errors.append('pixels of %s differ' % f)
+    return errors
+
+def best_stages(runs):
+    # The lowest cpu time, wall time and peak memory of every stage over the runs.
+    best = {}
+    for stages in runs:
+        for name, stage in stages.items():
+            b = best.setdefault(name, {'cpu_ms': stage['cpu_ms'], 'wall_ms': stage['wall_ms'], 'peak_rss_kb': stage['peak_rss_kb']})
+            for key in b:
+                b[key] = min(b[key], stage[key])
+    return best
+
+def check_perf(expected, got, tolerance, slack_ms, slack_kb):
+    errors = []
+    for name in sorted(expected):
+        if name not in got:
+            errors.append('stage %s did not run' % name)
+            continue
+        e, g = expected[name], got[name]
+        limit = e['cpu_ms'] * (1 + tolerance) + slack_ms
+        if g['cpu_ms'] > limit:
+            errors.append('%s: %.1f ms cpu, baseline %.1f ms, limit %.1f ms' % (name, g['cpu_ms'], e['cpu_ms'], limit))
+        limit = e['peak_rss_kb'] * (1 + tolerance) + slack_kb
+        if g['peak_rss_kb'] > limit:
+            errors.append('%s: %d kB peak memory, baseline %d kB, limit %d kB' % (name, g['peak_rss_kb'], e['peak_rss_kb'], limit))
+    return errors
+
+def main():
+    parser = argparse.ArgumentParser(description='Check apngopt and apngdisraw against the baselines in baselines.json.')
+    parser.add_argument('inputs', nargs='+', help='APNG files of the benchmark corpus, or names of synthetic inputs: %s.' % ', '.join(sorted(synthetic)))
+    parser.add_argument('--check', choices=['identity', 'perf'], required=True)
+    parser.add_argument('--bin-dir', action='append', default=[], help='Directory with apng2webp_apngopt and apngdisraw. Can be given more than once.')
+    parser.add_argument('--config', action='append', default=[], choices=sorted(configs), help='apngopt configuration to check. Defaults to all.')
+    parser.add_argument('--build-type', default='None', help='CMake build type, the timings are kept per build type.')
+    parser.add_argument('-r', '--repeat', type=int, default=3, help='Runs for --check perf. The best one counts.')
+    parser.add_argument('--tolerance', type=float, default=0.5, help='Allowed increase of a stage over its baseline, 0.5 is 50%%.')
+    parser.add_argument('--slack-ms', type=float, default=20.0, help='Allowed increase in ms on top of the tolerance, for short stages.')
+    parser.add_argument('--slack-kb', type=int, default=2048, help='Allowed increase in kB on top of the tolerance.')
+    parser.add_argument('--update', action='store_true', help='Record the reference (identity) or the timings of this machine (perf) instead of checking.')
+    args = parser.parse_args()
+
+    baselines = {'inputs': {}}
+    if path.isfile(baseline_file):
+        with open(baseline_file, 'r') as f:
+            baselines = json.load(f)
+
+    same_zlib = baselines.get('zlib') == zlib_version()
+    errors = []
+    skipped = []
+    workdir = tempfile.mkdtemp(prefix='apng2webp_perf_')
+    synthdir = tempfile.mkdtemp(prefix='apng2webp_synth_')
+    try:
+        inputs = []
+        for input_file in args.inputs:
+            if not path.isfile(input_file) and input_file in synthetic:
+                synth_apng.write_apng(path.join(synthdir, input_file), **synthetic[input_file])
+                input_file = path.join(synthdir, input_file)
+            inputs.append(input_file)
+
+        for input_file, config in [(i, c) for i in inputs for c in args.config or sorted(configs)]:
+            key = '%s %s' % (path.basename(input_file), config)
+            entry = baselines['inputs'].setdefault(key, {})
+
+            if args.check == 'identity':
+                stages, opt_file, frames = run_tools(args.bin_dir, input_file, configs[config], workdir)
+                if args.update:
+                    entry['reference'] = reference(workdir, opt_file, frames, True)
+                elif 'reference' not in entry:
+                    errors.append('%s: no reference, record one with --update' % key)
+                else:
+                    errors += ['%s: %s' % (key, e) for e in check_identity(entry['reference'], workdir, opt_file, frames, same_zlib)]
+                    if config == 'default':
+                        errors += ['%s: %s' % (key, e) for e in check_pipe(args.bin_dir, input_file, configs[config], workdir, opt_file, frames)]
+                        errors += ['%s: %s' % (key, e) for e in check_pack(args.bin_dir, opt_file, workdir, frames, entry['reference']['pixels'])]
+            else:
+                runs = []
+                for i in range(max(1, args.repeat)):
+                    stages, opt_file, frames = run_tools(args.bin_dir, input_file, configs[config], workdir)
+                    runs.append(stages)
+                best = best_stages(runs)
+                timings = entry.setdefault('timings', {})
+                if args.update:
+                    timings[args.build_type] = best
+                elif args.build_type not in timings:
+                    skipped.append(key)
+                else:
+                    errors += ['%s: %s' % (key, e) for e in check_perf(timings[args.build_type], best, args.tolerance, args.slack_ms, args.slack_kb)]
+    finally:
+        shutil.rmtree(workdir)
+        shutil.rmtree(synthdir)
+
+    if args.update:
+        if args.check == 'identity':
+            baselines['zlib'] = zlib_version()
+        with open(baseline_file, 'w') as f:
+            json.dump(baselines, f, indent=1, sort_keys=True)
+            f.write('\n')
+        print('updated %s' % baseline_file)
+        return 0
+
+    for e in errors:
+        print(e)
+    if errors:
+        return 1
+    if skipped:
+        print('no %s timings for %s, record them with --update' % (args.build_type, ', '.join(skipped)))
+        return SKIPPED
+    if args.check == 'identity' and not same_zlib:
+        print('zlib %s instead of %s, compared the decoded pixels' % (zlib_version(), baselines.get('zlib')))
+    print('ok')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
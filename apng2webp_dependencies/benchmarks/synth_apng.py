@@ -0,0 +1,185 @@
+#!/usr/bin/env python
+#-*- coding:utf-8 -*-
+
+# Writes synthetic APNG files for benchmarks and tests, with control over
+# the canvas size, the frame count, the color type, the number of colors,
+# the transparency and how much of the canvas each frame changes.
+#
+# The first frame covers the canvas. Every next frame replaces a rect of
+# `delta` times the canvas area at a random place (dispose none, blend
+# source), so a 4K canvas with 10000 small changes stays cheap to write and
+# to read. With full=True every frame is stored as the whole canvas
+# instead, like an animation that was never optimized.
+#
+# Pixels come in 8x8 blocks whose color is picked from `colors` colors by
+# a hash of the block position and the frame number, so the output only
+# depends on the parameters and the seed.
+
+import argparse
+import random
+import struct
+import sys
+import zlib
+
+BLOCK = 8
+
+color_types = {
+    # name: (PNG color type, bytes per pixel) without and with alpha
+    'rgba': ((6, 4), (6, 4)),
+    'rgb': ((2, 3), (2, 3)),
+    'palette': ((3, 1), (3, 1)),
+    'gray': ((0, 1), (4, 2)),
+}
+
+alpha_modes = ('none', 'binary', 'heavy')
+
+def _chunk(f, name, data):
+    f.write(struct.pack('>I', len(data)) + name + data + struct.pack('>I', zlib.crc32(name + data) & 0xffffffff))
+
+def _hash(a, b, c):
+    h = (a * 73856093 ^ b * 19349663 ^ c * 83492791) & 0xffffffff
+    h ^= h >> 13
+    h = (h * 0x5bd1e995) & 0xffffffff
+    return h ^ (h >> 15)
+
+class _Colors(object):
+    # The pixel bytes of color number i, in the format of the color type.
+
+    def __init__(self, color_type, alpha, seed):
+        self.color_type = color_type
+        self.alpha = alpha
+        self.seed = seed
+        self.cache = {}
+
+    def rgba(self, i):
+        h = _hash(i, 0, self.seed)
+        a = 255
+        if self.alpha == 'binary':
+            a = 0 if (h >> 24) & 1 else 255
+        elif self.alpha == 'heavy':
+            a = (h >> 24) & 0xff
+        if self.color_type == 'gray':
+            return (h & 0xff, h & 0xff, h & 0xff, a)
+        return (h & 0xff, (h >> 8) & 0xff, (h >> 16) & 0xff, a)
+
+    def pixel(self, i):
+        p = self.cache.get(i)
+        if p is None:
+            r, g, b, a = self.rgba(i)
+            if self.color_type == 'rgba':
+                p = bytearray((r, g, b, a))
+            elif self.color_type == 'rgb':
+                p = bytearray((r, g, b))
+            elif self.color_type == 'palette':
+                p = bytearray((i,))
+            elif self.alpha != 'none':
+                p = bytearray((r, a))
+            else:
+                p = bytearray((r,))
+            if len(self.cache) < 65536:
+                self.cache[i] = p
+        return p
+
+def _rows(colors, num_colors, x, y, w, h, frame):
+    # The rows of a w x h rect at x,y of frame number `frame`.
+    rows = []
+    row = None
+    for j in range(y, y + h):
+        if row is None or j % BLOCK == 0:
+            parts = []
+            i = x
+            while i < x + w:
+                n = min(BLOCK - i % BLOCK, x + w - i)
+                parts.append(colors.pixel(_hash(i // BLOCK, j // BLOCK, frame) % num_colors) * n)
+                i += n
+            row = b''.join(bytes(p) for p in parts)
+        rows.append(row)
+    return rows
+
+def _compress(rows, level):
+    return zlib.compress(b''.join(b'\0' + row for row in rows), level)
+
+def write_apng(path, width, height, frames, color_type='rgba', colors=256, alpha='binary', delta=0.05, full=False, delay=(1, 25), seed=0, level=6):
+    if width < 1 or height < 1 or frames < 1:
+        raise ValueError('width, height and frames must be at least 1')
+    if color_type not in color_types:
+        raise ValueError('color type must be one of %s' % ', '.join(sorted(color_types)))
+    if alpha not in alpha_modes:
+        raise ValueError('alpha must be one of %s' % ', '.join(alpha_modes))
+    if colors < 1 or (color_type in ('palette', 'gray') and colors > 256):
+        raise ValueError('colors must be at least 1, and at most 256 for palette and gray')
+    if delta <= 0 or delta > 1:
+        raise ValueError('delta must be more than 0 and at most 1')
+
+    png_type, bpp = color_types[color_type][alpha != 'none']
+    pixels = _Colors(color_type, alpha, seed)
+    rnd = random.Random(seed)
+    rect_w = max(1, min(width, int(round(width * delta ** 0.5))))
+    rect_h = max(1, min(height, int(round(height * delta ** 0.5))))
+    canvas = None
+    seq = 0
+
+    with open(path, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n')
+        _chunk(f, b'IHDR', struct.pack('>IIBBBBB', width, height, 8, png_type, 0, 0, 0))
+        if color_type == 'palette':
+            _chunk(f, b'PLTE', b''.join(struct.pack('BBB', *pixels.rgba(i)[:3]) for i in range(colors)))
+            if alpha != 'none':
+                _chunk(f, b'tRNS', b''.join(struct.pack('B', pixels.rgba(i)[3]) for i in range(colors)))
+        _chunk(f, b'acTL', struct.pack('>II', frames, 0))
+
+        for n in range(frames):
+            if n == 0:
+                x, y, w, h = 0, 0, width, height
+            else:
+                x = rnd.randint(0, width - rect_w)
+                y = rnd.randint(0, height - rect_h)
+                w, h = rect_w, rect_h
+            rows = _rows(pixels, colors, x, y, w, h, n)
+
+            if full:
+                if canvas is None:
+                    canvas = [bytearray(row) for row in rows]
+                else:
+                    for j in range(h):
+                        canvas[y + j][x * bpp:(x + w) * bpp] = rows[j]
+                x, y, w, h = 0, 0, width, height
+                rows = [bytes(row) for row in canvas]
+
+            _chunk(f, b'fcTL', struct.pack('>IIIIIHHBB', seq, w, h, x, y, delay[0], delay[1], 0, 0))
+            seq += 1
+            data = _compress(rows, level)
+            if n == 0:
+                _chunk(f, b'IDAT', data)
+            else:
+                _chunk(f, b'fdAT', struct.pack('>I', seq) + data)
+                seq += 1
+        _chunk(f, b'IEND', b'')
+
+def main():
+    parser = argparse.ArgumentParser(description='Write a synthetic APNG file.')
+    parser.add_argument('output', help='Output path.')
+    parser.add_argument('width', type=int)
+    parser.add_argument('height', type=int)
+    parser.add_argument('frames', type=int)
+    parser.add_argument('-t', '--color-type', choices=sorted(color_types), default='rgba', help='PNG color type. gray gets an alpha channel unless --alpha none.')
+    parser.add_argument('-c', '--colors', type=int, default=256, help='Number of different colors. At most 256 for palette and gray.')
+    parser.add_argument('-a', '--alpha', choices=alpha_modes, default='binary', help='none: opaque, binary: some colors fully transparent, heavy: any alpha value.')
+    parser.add_argument('-d', '--delta', type=float, default=0.05, help='Fraction of the canvas each frame after the first changes, more than 0 up to 1.')
+    parser.add_argument('--full', action='store_true', help='Store every frame as the whole canvas.')
+    parser.add_argument('--delay', default='1/25', help='Frame delay as num/den seconds.')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--level', type=int, default=6, help='zlib level, 1 is the fastest to write.')
+    args = parser.parse_args()
+
+    try:
+        num, den = (int(v) for v in args.delay.split('/'))
+    except ValueError:
+        parser.error('delay must be num/den')
+    try:
+        write_apng(args.output, args.width, args.height, args.frames, args.color_type, args.colors, args.alpha, args.delta, args.full, (num, den), args.seed, args.level)
+    except ValueError as e:
+        parser.error(str(e))
+
+if __name__ == '__main__':
+    main()
@@ -14,7 +14,7 @@ libfind_pkg_check_modules(Jsoncpp_PKGCONF jsoncpp)
 
 # Include dir
 find_path(Jsoncpp_INCLUDE_DIR
-  NAMES json/features.h
+  NAMES json/json.h json/features.h
   PATH_SUFFIXES jsoncpp
   PATHS ${Jsoncpp_PKGCONF_INCLUDE_DIRS} # /usr/include/jsoncpp/json
 )
@@ -0,0 +1,237 @@
+/* Heap allocation accounting for apngopt and apngdisraw.
+ *
+ * Built in with -DTRACK_ALLOC=ON (it defines APNG2WEBP_TRACK_ALLOC), off
+ * otherwise. It replaces the global operator new and delete, and
+ * ALLOC_ZALLOC/ALLOC_ZFREE and ALLOC_PNG_MALLOC/ALLOC_PNG_FREE hook the
+ * z_streams and the libpng structs, which take a site name as their
+ * opaque/mem pointer. Without TRACK_ALLOC the hooks are NULL, the zlib and
+ * libpng defaults.
+ *
+ * Every block gets a 16 byte header holding its size. The number of
+ * allocations, the bytes, the live bytes and their peak are kept, and per
+ * site (the caller of operator new, or the hook's name) the allocations
+ * and bytes. stats_write() reports them with the largest sites first.
+ * Sites are named through dladdr(), so the binaries are linked with
+ * -rdynamic; static functions show up as the exported function before
+ * them, or as an address.
+ *
+ * stats.h includes it, after png.h and zlib.h. Only one translation unit
+ * per binary may include it: the tools are single files.
+ *
+ * zlib license, like the tools.
+ */
+#ifndef APNG2WEBP_ALLOC_H
+#define APNG2WEBP_ALLOC_H
+
+#ifdef APNG2WEBP_TRACK_ALLOC
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <mutex>
+#include <algorithm>
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <cxxabi.h>
+#endif
+
+#define ALLOC_ZALLOC     alloc_zalloc
+#define ALLOC_ZFREE      alloc_zfree
+#define ALLOC_PNG_MALLOC alloc_png_malloc
+#define ALLOC_PNG_FREE   alloc_png_free
+
+const unsigned int cAllocSites = 509;
+const unsigned int cAllocTopSites = 10;
+const size_t cAllocHeader = 16;
+
+// name is set for the hooks, key is the return address or the name. Allocations
+// from sites that don't fit the table are only counted as site_overflows. The
+// key may be NULL (no return address on this compiler), so used marks the slot.
+struct ALLOCSITE { bool used; const void * key; const char * name; unsigned long long allocs, bytes; };
+struct ALLOC { std::mutex m; unsigned long long allocs, frees, bytes, live, peak, stage_peak; unsigned int site_overflows; ALLOCSITE sites[cAllocSites]; };
+
+static ALLOC alloc;
+
+static void stats_string(FILE * f, const char * s);
+
+static void * alloc_malloc(size_t size, const void * key, const char * name)
+{
+  unsigned char * p = (unsigned char *)malloc(size + cAllocHeader);
+  if (!p)
+    return NULL;
+  *(size_t *)p = size;
+
+  std::lock_guard<std::mutex> lock(alloc.m);
+  alloc.allocs++;
+  alloc.bytes += size;
+  alloc.live += size;
+  if (alloc.live > alloc.peak)
+    alloc.peak = alloc.live;
+  if (alloc.live > alloc.stage_peak)
+    alloc.stage_peak = alloc.live;
+
+  // open addressing, no allocations in here
+  unsigned int i = (unsigned int)(((size_t)key >> 4) % cAllocSites);
+  for (unsigned int n=0; n<cAllocSites; n++, i=(i+1)%cAllocSites)
+    if (alloc.sites[i].key == key || !alloc.sites[i].used)
+    {
+      alloc.sites[i].used = true;
+      alloc.sites[i].key = key;
+      alloc.sites[i].name = name;
+      alloc.sites[i].allocs++;
+      alloc.sites[i].bytes += size;
+      return p + cAllocHeader;
+    }
+  alloc.site_overflows++;
+  return p + cAllocHeader;
+}
+
+static void alloc_free(void * ptr)
+{
+  if (!ptr)
+    return;
+  unsigned char * p = (unsigned char *)ptr - cAllocHeader;
+  {
+    std::lock_guard<std::mutex> lock(alloc.m);
+    alloc.frees++;
+    alloc.live -= *(size_t *)p;
+  }
+  free(p);
+}
+
+// The hooks are static inline, apngdisraw doesn't use the zlib ones.
+static inline voidpf alloc_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  return alloc_malloc((size_t)items * size, opaque, (const char *)opaque);
+}
+
+static inline void alloc_zfree(voidpf, voidpf address)
+{
+  alloc_free(address);
+}
+
+static inline png_voidp alloc_png_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+  const char * name = (const char *)png_get_mem_ptr(png_ptr);
+  return alloc_malloc(size, name, name);
+}
+
+static inline void alloc_png_free(png_structp, png_voidp ptr)
+{
+  alloc_free(ptr);
+}
+
+// The peak of the live bytes from here on, for the stages of stats.h.
+static void alloc_stage_begin()
+{
+  std::lock_guard<std::mutex> lock(alloc.m);
+  alloc.stage_peak = alloc.live;
+}
+
+static unsigned long long alloc_stage_peak()
+{
+  std::lock_guard<std::mutex> lock(alloc.m);
+  return alloc.stage_peak;
+}
+
+static bool alloc_cmp_bytes(const ALLOCSITE & a, const ALLOCSITE & b)
+{
+  return a.bytes > b.bytes;
+}
+
+static void alloc_site_name(char * buf, size_t size, const ALLOCSITE & site)
+{
+  if (site.name || !site.key)
+  {
+    snprintf(buf, size, "%s", (site.name) ? site.name : "operator new");
+    return;
+  }
+#ifndef _WIN32
+  Dl_info info;
+  if (dladdr(site.key, &info) && info.dli_sname)
+  {
+    int status;
+    char * demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+    const char * fn = (status == 0) ? demangled : info.dli_sname;
+    snprintf(buf, size, "%.*s+0x%lx", (int)strcspn(fn, "("), fn, (unsigned long)((const char *)site.key - (const char *)info.dli_saddr));
+    free(demangled);
+    return;
+  }
+#endif
+  snprintf(buf, size, "%p", site.key);
+}
+
+// The "alloc" member of the stats.h output.
+static void alloc_write(FILE * f)
+{
+  static ALLOCSITE sites[cAllocSites];
+  unsigned int n = 0;
+  char name[256];
+
+  std::unique_lock<std::mutex> lock(alloc.m);
+  for (unsigned int i=0; i<cAllocSites; i++)
+    if (alloc.sites[i].used)
+      sites[n++] = alloc.sites[i];
+  fprintf(f, ",\n  \"alloc\": {\n    \"allocs\": %llu,\n    \"frees\": %llu,\n    \"bytes\": %llu,\n    \"live_bytes\": %llu,\n    \"peak_live_bytes\": %llu,\n    \"site_overflows\": %u,\n    \"sites\": [",
+    alloc.allocs, alloc.frees, alloc.bytes, alloc.live, alloc.peak, alloc.site_overflows);
+  lock.unlock();
+
+  std::sort(sites, sites + n, alloc_cmp_bytes);
+  for (unsigned int i=0; i<n && i<cAllocTopSites; i++)
+  {
+    alloc_site_name(name, sizeof(name), sites[i]);
+    fprintf(f, "%s\n      { \"site\": ", (i) ? "," : "");
+    stats_string(f, name);
+    fprintf(f, ", \"allocs\": %llu, \"bytes\": %llu }", sites[i].allocs, sites[i].bytes);
+  }
+  fprintf(f, "\n    ]\n  }");
+}
+
+#ifdef __GNUC__
+#define ALLOC_CALLER __builtin_return_address(0)
+#else
+#define ALLOC_CALLER NULL
+#endif
+
+void * operator new(size_t size)
+{
+  void * p = alloc_malloc(size, ALLOC_CALLER, NULL);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void * operator new[](size_t size)
+{
+  void * p = alloc_malloc(size, ALLOC_CALLER, NULL);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  return alloc_malloc(size, ALLOC_CALLER, NULL);
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return alloc_malloc(size, ALLOC_CALLER, NULL);
+}
+
+void operator delete(void * p) noexcept { alloc_free(p); }
+void operator delete[](void * p) noexcept { alloc_free(p); }
+void operator delete(void * p, const std::nothrow_t &) noexcept { alloc_free(p); }
+void operator delete[](void * p, const std::nothrow_t &) noexcept { alloc_free(p); }
+
+#else
+
+#define ALLOC_ZALLOC     Z_NULL
+#define ALLOC_ZFREE      Z_NULL
+#define ALLOC_PNG_MALLOC NULL
+#define ALLOC_PNG_FREE   NULL
+
+#endif /* APNG2WEBP_TRACK_ALLOC */
+
+#endif /* APNG2WEBP_ALLOC_H */
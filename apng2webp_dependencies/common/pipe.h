@@ -0,0 +1,145 @@
+/* "-" as a file name for apngopt and apngdisraw: stdin and stdout.
+ *
+ * pipe_open_in() opens a file for reading, or stdin for "-". Pass seekable
+ * when the file is seeked in or opened more than once: stdin is then read
+ * into memory first, and every later open reads it from there. Otherwise
+ * stdin is read as it comes in.
+ *
+ * pipe_stdout() points stdout at stderr, so the messages of the tools stay
+ * out of the output, and returns a stream on the real stdout. It is called
+ * once, before the first message. pipe_open_out() opens a file for writing,
+ * or for "-" a stream in memory that pipe_close_out() copies to stdout, as
+ * apngopt seeks back to patch acTL. Windows has no memory streams, there it
+ * is a temporary file.
+ *
+ * The functions are static inline, apngdisraw doesn't use pipe_open_out()
+ * and pipe_close_out().
+ *
+ * zlib license, like the tools.
+ */
+#ifndef APNG2WEBP_PIPE_H
+#define APNG2WEBP_PIPE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define pipe_dup _dup
+#define pipe_dup2 _dup2
+#define pipe_fileno _fileno
+#define pipe_fdopen _fdopen
+#else
+#include <unistd.h>
+#define pipe_dup dup
+#define pipe_dup2 dup2
+#define pipe_fileno fileno
+#define pipe_fdopen fdopen
+#endif
+
+struct PIPE { bool buffered; std::vector<unsigned char> in; FILE * out; FILE * mem; char * mem_buf; size_t mem_size; };
+
+static PIPE pipe_io;
+
+static inline bool pipe_is_std(const char * szName)
+{
+  return strcmp(szName, "-") == 0;
+}
+
+static inline FILE * pipe_memory_in()
+{
+#ifdef _WIN32
+  FILE * f = tmpfile();
+  if (f)
+  {
+    if (!pipe_io.in.empty())
+      fwrite(&pipe_io.in[0], 1, pipe_io.in.size(), f);
+    rewind(f);
+  }
+  return f;
+#else
+  if (pipe_io.in.empty())
+    return NULL;
+  return fmemopen(&pipe_io.in[0], pipe_io.in.size(), "rb");
+#endif
+}
+
+static inline FILE * pipe_open_in(const char * szIn, bool seekable)
+{
+  if (!pipe_is_std(szIn))
+    return fopen(szIn, "rb");
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  if (pipe_io.buffered)
+    return pipe_memory_in();
+  if (!seekable)
+    return stdin;
+
+  unsigned char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+    pipe_io.in.insert(pipe_io.in.end(), buf, buf + n);
+  pipe_io.buffered = true;
+  return pipe_memory_in();
+}
+
+static inline FILE * pipe_stdout()
+{
+  if (!pipe_io.out)
+  {
+    fflush(stdout);
+    int fd = pipe_dup(pipe_fileno(stdout));
+    pipe_dup2(pipe_fileno(stderr), pipe_fileno(stdout));
+#ifdef _WIN32
+    _setmode(fd, _O_BINARY);
+#endif
+    pipe_io.out = pipe_fdopen(fd, "wb");
+  }
+  return pipe_io.out;
+}
+
+static inline FILE * pipe_open_out(const char * szOut)
+{
+  if (!pipe_is_std(szOut))
+    return fopen(szOut, "wb");
+#ifdef _WIN32
+  pipe_io.mem = tmpfile();
+#else
+  pipe_io.mem = open_memstream(&pipe_io.mem_buf, &pipe_io.mem_size);
+#endif
+  return pipe_io.mem;
+}
+
+// A memory stream ends where it was last written, so after patching one seek back to its end first.
+static inline int pipe_close_out(FILE * f)
+{
+  if (f != pipe_io.mem)
+    return fclose(f);
+
+  FILE * out = pipe_stdout();
+  int res = 0;
+#ifdef _WIN32
+  char buf[65536];
+  size_t n;
+  rewind(f);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    if (fwrite(buf, 1, n, out) != n)
+      res = EOF;
+  fclose(f);
+#else
+  fclose(f);
+  if (pipe_io.mem_size && fwrite(pipe_io.mem_buf, 1, pipe_io.mem_size, out) != pipe_io.mem_size)
+    res = EOF;
+  free(pipe_io.mem_buf);
+  pipe_io.mem_buf = NULL;
+#endif
+  pipe_io.mem = NULL;
+  if (fflush(out) != 0)
+    res = EOF;
+  return res;
+}
+
+#endif /* APNG2WEBP_PIPE_H */
@@ -0,0 +1,236 @@
+/* Per-stage timing for apngopt and apngdisraw.
+ *
+ * Off unless stats.enabled is set. stats_begin()/stats_end() bracket a
+ * stage. Stages with the same name are added up, with the number of calls.
+ * For each stage the wall time, the cpu time of the whole process (all
+ * threads) and the peak resident memory while it ran are kept.
+ * stats_record() adds a record, a JSON object, to a named list, for
+ * things like the frames. It may be called from any thread.
+ * stats_write() writes it all as one JSON object.
+ *
+ * Stages are also trace events when tracing is on, see trace.h. When the
+ * heap is tracked (alloc.h), every stage gets the peak of the live heap
+ * bytes while it ran, and the output an "alloc" member.
+ *
+ * The peak of a single stage needs Linux, where the peak can be reset
+ * through /proc/self/clear_refs. Elsewhere it is the peak of the process
+ * so far, and 0 on Windows. On Windows the cpu time is the clock() time.
+ *
+ * zlib license, like the tools.
+ */
+#ifndef APNG2WEBP_STATS_H
+#define APNG2WEBP_STATS_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include "trace.h"
+#include "alloc.h"
+#ifdef _WIN32
+#include <time.h>
+#else
+#include <sys/resource.h>
+#endif
+
+struct STAGE { std::string name; unsigned int calls; double wall_ms, cpu_ms; unsigned long peak_rss_kb; unsigned long long peak_heap; };
+struct RECORDS { std::string name; std::vector<std::string> items; };
+struct STATS { bool enabled; std::vector<STAGE> stages; std::vector<RECORDS> lists; std::mutex m; unsigned int cur; double cpu_start; std::chrono::steady_clock::time_point start, stage_start; };
+
+static STATS stats;
+
+static double stats_cpu_ms()
+{
+#ifdef _WIN32
+  // not cpu time there, windows.h would clash with the tools' names
+  return clock() * 1e3 / CLOCKS_PER_SEC;
+#else
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+#endif
+}
+
+// Peak resident memory since the last stats_reset_peak(), in kB.
+static unsigned long stats_peak_rss_kb()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  unsigned long kb = 0;
+  FILE * f = fopen("/proc/self/status", "r");
+  if (f)
+  {
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+      if (sscanf(line, "VmHWM: %lu", &kb) == 1)
+        break;
+    fclose(f);
+  }
+  if (kb == 0)
+  {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    kb = ru.ru_maxrss;
+#ifdef __APPLE__
+    kb /= 1024;
+#endif
+  }
+  return kb;
+#endif
+}
+
+static void stats_reset_peak()
+{
+#ifdef __linux__
+  FILE * f = fopen("/proc/self/clear_refs", "w");
+  if (f)
+  {
+    fputs("5", f);
+    fclose(f);
+  }
+#endif
+}
+
+static void stats_begin(const char * name)
+{
+  trace_begin(name);
+  if (!stats.enabled)
+    return;
+  if (stats.stages.empty())
+    stats.start = std::chrono::steady_clock::now();
+
+  for (stats.cur=0; stats.cur<stats.stages.size(); stats.cur++)
+    if (stats.stages[stats.cur].name == name)
+      break;
+  if (stats.cur == stats.stages.size())
+  {
+    STAGE stage = { name, 0, 0, 0, 0, 0 };
+    stats.stages.push_back(stage);
+  }
+
+  stats_reset_peak();
+#ifdef APNG2WEBP_TRACK_ALLOC
+  alloc_stage_begin();
+#endif
+  stats.cpu_start = stats_cpu_ms();
+  stats.stage_start = std::chrono::steady_clock::now();
+}
+
+static void stats_end()
+{
+  trace_end();
+  if (!stats.enabled)
+    return;
+
+  STAGE & stage = stats.stages[stats.cur];
+  unsigned long peak = stats_peak_rss_kb();
+
+  stage.calls++;
+  stage.wall_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stats.stage_start).count();
+  stage.cpu_ms += stats_cpu_ms() - stats.cpu_start;
+  if (peak > stage.peak_rss_kb)
+    stage.peak_rss_kb = peak;
+#ifdef APNG2WEBP_TRACK_ALLOC
+  stage.peak_heap = std::max(stage.peak_heap, alloc_stage_peak());
+#endif
+}
+
+// fmt makes the members of the record, without the braces.
+static void stats_record(const char * list, const char * fmt, ...)
+{
+  char buf[1024];
+  size_t i;
+  va_list args;
+
+  if (!stats.enabled)
+    return;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  std::lock_guard<std::mutex> lock(stats.m);
+  for (i=0; i<stats.lists.size(); i++)
+    if (stats.lists[i].name == list)
+      break;
+  if (i == stats.lists.size())
+  {
+    stats.lists.push_back(RECORDS());
+    stats.lists.back().name = list;
+  }
+  stats.lists[i].items.push_back(buf);
+}
+
+static void stats_string(FILE * f, const char * s)
+{
+  fputc('"', f);
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else
+    if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static int stats_write(const char * szFile, const char * tool, const char * szIn)
+{
+  FILE * f;
+  unsigned long peak = 0;
+
+  if ((f = fopen(szFile, "w")) == 0)
+  {
+    printf("Error: couldn't open '%s' for writing\n", szFile);
+    return 1;
+  }
+
+  for (size_t i=0; i<stats.stages.size(); i++)
+    if (stats.stages[i].peak_rss_kb > peak)
+      peak = stats.stages[i].peak_rss_kb;
+
+  fprintf(f, "{\n  \"tool\": ");
+  stats_string(f, tool);
+  fprintf(f, ",\n  \"input\": ");
+  stats_string(f, szIn);
+  fprintf(f, ",\n  \"wall_ms\": %.3f,\n  \"cpu_ms\": %.3f,\n  \"peak_rss_kb\": %lu,\n  \"stages\": [",
+    (stats.stages.empty()) ? 0 : std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stats.start).count(),
+    stats_cpu_ms(), peak);
+  for (size_t i=0; i<stats.stages.size(); i++)
+  {
+    const STAGE & stage = stats.stages[i];
+    fprintf(f, "%s\n    { \"name\": ", (i) ? "," : "");
+    stats_string(f, stage.name.c_str());
+    fprintf(f, ", \"calls\": %u, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kb\": %lu", stage.calls, stage.wall_ms, stage.cpu_ms, stage.peak_rss_kb);
+#ifdef APNG2WEBP_TRACK_ALLOC
+    fprintf(f, ", \"peak_heap_kb\": %llu", (stage.peak_heap + 1023) >> 10);
+#endif
+    fprintf(f, " }");
+  }
+  fprintf(f, "\n  ]");
+  for (size_t i=0; i<stats.lists.size(); i++)
+  {
+    const RECORDS & list = stats.lists[i];
+    fprintf(f, ",\n  ");
+    stats_string(f, list.name.c_str());
+    fprintf(f, ": [");
+    for (size_t j=0; j<list.items.size(); j++)
+      fprintf(f, "%s\n    { %s }", (j) ? "," : "", list.items[j].c_str());
+    fprintf(f, "\n  ]");
+  }
+#ifdef APNG2WEBP_TRACK_ALLOC
+  alloc_write(f);
+#endif
+  fprintf(f, "\n}\n");
+  fclose(f);
+  return 0;
+}
+
+#endif /* APNG2WEBP_STATS_H */
@@ -0,0 +1,119 @@
+/* Chrome trace events for apngopt and apngdisraw.
+ *
+ * Off unless trace.enabled is set. trace_begin()/trace_end() bracket a
+ * stage on the calling thread, trace_complete() adds a span that was
+ * measured already, like the decoding of one frame. trace_write() writes
+ * them in the JSON format of chrome://tracing and ui.perfetto.dev.
+ *
+ * Timestamps are microseconds of the system clock, so the events of the
+ * tools line up with those of the driver when it merges the files. Threads
+ * are numbered in the order they first add an event, the first is 1.
+ *
+ * zlib license, like the tools.
+ */
+#ifndef APNG2WEBP_TRACE_H
+#define APNG2WEBP_TRACE_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#ifdef _WIN32
+#include <process.h>
+#define trace_getpid _getpid
+#else
+#include <unistd.h>
+#define trace_getpid getpid
+#endif
+
+struct TRACE { bool enabled; std::vector<std::string> events; std::mutex m; std::atomic<int> threads; double epoch_us; std::chrono::steady_clock::time_point start; };
+
+static TRACE trace;
+
+static int trace_tid()
+{
+  static thread_local int tid = 0;
+  if (tid == 0)
+    tid = ++trace.threads;
+  return tid;
+}
+
+static double trace_us(std::chrono::steady_clock::time_point t)
+{
+  return trace.epoch_us + std::chrono::duration<double, std::micro>(t - trace.start).count();
+}
+
+static void trace_event(const char * fmt, const char * name, double ts, double dur, int frame)
+{
+  char buf[256];
+  int n = snprintf(buf, sizeof(buf), fmt, name, (int)trace_getpid(), trace_tid(), ts, dur);
+  if (frame >= 0 && n > 0 && n < (int)sizeof(buf))
+    snprintf(buf + n, sizeof(buf) - n, ", \"args\": { \"frame\": %d }", frame);
+
+  std::lock_guard<std::mutex> lock(trace.m);
+  trace.events.push_back(buf);
+}
+
+static void trace_thread_name(const char * name)
+{
+  if (!trace.enabled)
+    return;
+  char buf[128];
+  snprintf(buf, sizeof(buf), "\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": { \"name\": \"%s\" }", (int)trace_getpid(), trace_tid(), name);
+  std::lock_guard<std::mutex> lock(trace.m);
+  trace.events.push_back(buf);
+}
+
+// Call on the main thread before the first event. tool names the process in the viewer.
+static void trace_start(const char * tool)
+{
+  char buf[128];
+  trace.enabled = true;
+  trace.start = std::chrono::steady_clock::now();
+  trace.epoch_us = std::chrono::duration<double, std::micro>(std::chrono::system_clock::now().time_since_epoch()).count();
+  snprintf(buf, sizeof(buf), "\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": { \"name\": \"%s\" }", (int)trace_getpid(), tool);
+  trace.events.push_back(buf);
+  trace_thread_name("main");
+}
+
+static void trace_begin(const char * name, int frame = -1)
+{
+  if (trace.enabled)
+    trace_event("\"name\": \"%s\", \"ph\": \"B\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f", name, trace_us(std::chrono::steady_clock::now()), 0, frame);
+}
+
+static void trace_end()
+{
+  if (trace.enabled)
+    trace_event("\"name\": \"%s\", \"ph\": \"E\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f", "", trace_us(std::chrono::steady_clock::now()), 0, -1);
+}
+
+static void trace_complete(const char * name, std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1, int frame = -1)
+{
+  if (trace.enabled)
+    trace_event("\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", name, trace_us(t0),
+                std::chrono::duration<double, std::micro>(t1 - t0).count(), frame);
+}
+
+static int trace_write(const char * szFile)
+{
+  FILE * f;
+
+  if ((f = fopen(szFile, "w")) == 0)
+  {
+    printf("Error: couldn't open '%s' for writing\n", szFile);
+    return 1;
+  }
+
+  std::lock_guard<std::mutex> lock(trace.m);
+  fprintf(f, "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [");
+  for (size_t i=0; i<trace.events.size(); i++)
+    fprintf(f, "%s\n    { %s }", (i) ? "," : "", trace.events[i].c_str());
+  fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+  return 0;
+}
+
+#endif /* APNG2WEBP_TRACE_H */